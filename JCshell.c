@@ -3,870 +3,2541 @@
  * JC Shell is a program that imitates a bash shell
  * It takes upto five commands using pipe '|'
  * After executing each command it would print out the stats
- * of running the process. 
+ * of running the process.
+ * Pipelines can be joined into lists with ; && || ( ) and { ; }
+ * and a command can read a here-document (<<EOF) or here-string (<<<)
  */
 
+#define _GNU_SOURCE // pipe2(), tee(), splice(), memfd_create()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <errno.h>
 #include <fcntl.h>
 
 int maxChar = 1024;
 int maxString = 30;
 int maxCommands = 5;
-int isSkip = 0;
+int maxReplicas = 16; // replicas of a parallel stage (cmd @par=N)
+int parChunk = 64 * 1024;
+int jobNotStarted = -1; // run_pipeline() result when a pipe or fork failed
+int isSubshell = 0; // set in the copy of the shell that runs ( ... )
+int stageInput = -1, stageOutput = -1; // pipe ends of a ( ) or { } pipeline stage, -1 for the shell's stdin/stdout
+int isExtendedMetrics = 0; // JCSHELL_XMETRICS=1 adds /proc io and schedstat to the stats line
+long long cacheMax = 64LL << 20; // JCSHELL_CACHE_MAX, bytes the result cache may hold
+int cacheHits = 0, cacheMisses = 0;
+double defaultTimeout = 0; // JCSHELL_TIMEOUT, deadline of jobs without a timeout prefix
+double killGrace = 5;      // seconds from SIGTERM to SIGKILL of a job past its deadline
 pid_t currPid;
 
-int start_process();
+// deadline of the running job, armed only while a job with a timeout runs
+int deadlineFd = -1;
+int deadlineStage = 0; // 1 once the job got SIGTERM, 2 once it got SIGKILL
+long long deadlineTime; // monotonic_us() when the job got SIGTERM
+pid_t jobGroup = 0;    // process group of the running job while it has a deadline
+double jobTimeout;
+int *jobPipes, numberOfJobPipes; // pipe ends of the job being started, closed by ( ) and { } stages
+
+// children of the running job and when each of them exited (monotonic_us(),
+// 0 while it runs), noted by sigchld_Handler() as it happens
+pid_t *watchedPids;
+long long *exitTimes;
+volatile sig_atomic_t numberOfWatched = 0;
+
+// chrome trace output (JCSHELL_TRACE=<file>), -1 when tracing is disabled
+int traceFd = -1;
+struct timespec traceStart;
+
+// microseconds since tracing started, 0 when tracing is disabled
+long long trace_now()
+{
+    struct timespec now;
+
+    if (traceFd < 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - traceStart.tv_sec) * 1000000LL + (now.tv_nsec - traceStart.tv_nsec) / 1000;
+}
 
-// handle wrong pipe cases (e.g. '||' or '| at the start or end')
-void wrongpipe_handler(char *line)
+// microseconds on the monotonic clock, for the wall time of commands
+long long monotonic_us()
 {
-    // handle extreme pipe cases (e.g. "| at the start or end")
-    if (line[0] == '|' || line[strlen(line) - 2] == '|')
-    {
-        printf("| cannot be at the start or at the end\n");
-        start_process();
-    }
+    struct timespec now;
 
-    // handle extreme pipe cases (e.g. "||")
-    for (int i = 0; i < strlen(line) - 1; i++)
-    {
-        if (line[i] == '|' && line[i + 1] == '|')
-        {
-            printf("|| is not allowed\n");
-            start_process();
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
 
-    return;
+// trace timestamp of a monotonic_us() time, 0 when tracing is disabled
+long long trace_time(long long monotonic)
+{
+    if (traceFd < 0)
+        return 0;
+    return monotonic - (traceStart.tv_sec * 1000000LL + traceStart.tv_nsec / 1000);
 }
 
-// parse user input to get commands
-void parse_commands(const char *line, int *numberOfCommands, int *numberOfPipes, char commands[][100])
+// copy src into dst as the body of a JSON string
+void trace_escape(char *dst, int size, const char *src)
 {
-    int start = 0; // start of command
-    *numberOfCommands = 0;
-    *numberOfPipes = 0;
+    int len = 0;
 
-    for (int i = 0; i < strlen(line); i++)
+    for (; *src != '\0' && len < size - 7; src++)
     {
-        if (line[i] == '|')
+        if (*src == '"' || *src == '\\')
+        {
+            dst[len++] = '\\';
+            dst[len++] = *src;
+        }
+        else if ((unsigned char)*src < 0x20)
+        {
+            len += sprintf(dst + len, "\\u%04x", *src);
+        }
+        else
         {
-            (*numberOfCommands)++;
-            strncpy(commands[*numberOfCommands - 1], line + start, i - start); // Copy the command to the array
-            commands[*numberOfCommands - 1][i - start] = '\0';                 // Null-terminate the command
-            (*numberOfPipes)++;
-            start = i + 1; // start of next command
+            dst[len++] = *src;
         }
     }
-
-    // Copy the last command
-    strncpy(commands[*numberOfCommands], line + start, strlen(line) - start);
-    commands[*numberOfCommands][strlen(line) - start] = '\0';
-    (*numberOfCommands)++;
+    dst[len] = '\0';
 }
 
-void sigint_Handler(int sigint)
+// write one trace event ('X' complete, 'i' instant, 'M' track name or 'P' process name)
+// each event goes out in a single write() on an O_APPEND descriptor, so
+// events written by the shell and by its children never interleave
+void trace_event(const char *name, char phase, int tid, long long ts, long long dur, const char *args)
 {
-    // child process handles in default way, otherwise this
-    //  JCshell process handling SIGINT
-    printf("\n## JCshell [%d] ## ", currPid);
-    fflush(stdout);
+    char event[512], escaped[200];
+    int len;
+
+    if (traceFd < 0)
+        return;
+
+    trace_escape(escaped, sizeof(escaped), name);
+    if (phase == 'X')
+    {
+        len = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld%s%s},\n",
+                       escaped, currPid, tid, ts, dur, args ? ",\"args\":" : "", args ? args : "");
+    }
+    else if (phase == 'i')
+    {
+        len = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%lld%s%s},\n",
+                       escaped, currPid, tid, ts, args ? ",\"args\":" : "", args ? args : "");
+    }
+    else
+    {
+        len = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                       phase == 'P' ? "process_name" : "thread_name", currPid, tid, escaped);
+    }
+
+    if (len >= sizeof(event))
+        len = sizeof(event) - 1;
+    write(traceFd, event, len);
 }
 
-void sigusr_Handler(int sigusr1)
+// give the track of a stage a readable name in Perfetto (e.g. "stage 2: grep foo")
+void trace_stage_name(pid_t childPID, const char *label, char *arguments[])
 {
-    sleep(0.5);
+    char name[150];
+    int len;
+
+    if (traceFd < 0)
+        return;
+
+    len = snprintf(name, sizeof(name), "%s:", label);
+    for (int i = 0; arguments[i] != NULL && len < sizeof(name); i++)
+        len += snprintf(name + len, sizeof(name) - len, " %s", arguments[i]);
+    trace_event(name, 'M', childPID, 0, 0, NULL);
 }
 
-void getProcessStatistics(pid_t childPID, char *command, int status)
+// JCSHELL_TRACE=<file> records the lifecycle of every job as chrome trace
+// event JSON which loads in ui.perfetto.dev or chrome://tracing. The array
+// is left unterminated on purpose, the trace format allows a missing ']'
+void trace_open()
 {
+    char *path = getenv("JCSHELL_TRACE");
 
-    int foo_int, pid, ppid, excode, vctx, nvctx;
-    unsigned long user, sys, foo_long;
-    char foo_char, state, statStr[50], statusStr[50], cmd[50], line[maxChar];
-    FILE *statFile, *statusFile;
+    if (path == NULL || path[0] == '\0')
+        return;
 
-    siginfo_t processInfo;
-    struct rusage usage;
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (traceFd < 0)
+    {
+        perror("JCSHELL_TRACE");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    write(traceFd, "[\n", 2);
+    trace_event("JCshell", 'P', currPid, 0, 0, NULL);
+    trace_event("JCshell", 'M', currPid, 0, 0, NULL);
+}
 
-    int ret = waitid(P_ALL, 0, &processInfo, WNOWAIT | WEXITED);
-    if (!ret)
+// kinds of tokens of a command line
+enum
+{
+    TOKEN_WORD,
+    TOKEN_PIPE,   // |
+    TOKEN_FANOUT, // |>
+    TOKEN_AND,    // &&
+    TOKEN_OR,     // ||
+    TOKEN_SEMI,   // ;
+    TOKEN_LPAREN, // (
+    TOKEN_RPAREN, // )
+    TOKEN_LBRACE, // { as a word of its own
+    TOKEN_RBRACE, // } as a word of its own
+    TOKEN_HEREDOC,    // <<
+    TOKEN_HERESTRING, // <<<
+    TOKEN_END
+};
+
+// kinds of nodes of a parsed command line
+enum
+{
+    NODE_PIPELINE,
+    NODE_SEQUENCE, // left ; right
+    NODE_AND,      // left && right
+    NODE_OR,       // left || right
+    NODE_SUBSHELL, // ( left ), runs in a forked copy of the shell
+    NODE_GROUP     // { left ; }, runs in the shell itself, or in a forked copy as a pipeline stage
+};
+
+// commands connected with pipes, an optional parallel stage and an
+// optional fan-out into consumers
+struct pipeline
+{
+    int numberOfCommands, numberOfConsumers;
+    int parallelStage, numberOfReplicas, isOrdered;
+    char ***arguments; // argument vectors for execvp, up to maxCommands
+    struct node **units; // ( ) or { } run by a stage instead of its arguments, NULL for a command
+    char ***consumers;
+    int *inputFds; // here-document of each command, -1 to read from the pipe
+    int outputFd;  // where the job writes its output, -1 for the shell's stdout
+    double timeout; // seconds, 0 for no deadline
+    int isTimedOut;
+    int hasExecFailed; // a stage exited 126 or 127, its command could not run
+};
+
+struct node
+{
+    int type;
+    struct node *left, *right;
+    struct pipeline *pipeline; // NODE_PIPELINE only
+};
+
+// lexer state while parsing one command line
+struct parser
+{
+    char *line;
+    int token;
+    char *word; // text of the current TOKEN_WORD, owned by the parser
+    int isError;
+    int isInFanout; // between the { } of a fan-out, where } after a word closes the list
+};
+
+// statistics of a terminated child as printed by getProcessStatistics()
+struct processStats
+{
+    int pid, ppid, status, vctx, nvctx;
+    char state;
+    unsigned long user, sys;
+    long maxRss; // kB, from wait4()
+    unsigned long long rchar, wchar, readBytes, writeBytes, runDelay; // extended metrics
+    int isTimedOut; // killed for running past the job's deadline
+    long long wallTime; // microseconds from fork until it exited
+};
+
+// one replica of a parallel stage as seen from the shell
+struct replica
+{
+    int inFd, outFd;       // shell ends of the replica's stdin and stdout, -1 once closed
+    char *pending;         // input not yet written to the replica
+    size_t pendingLength;
+    char *chunk;           // line-aligned chunk handed to the replica (streaming mode)
+    char *output;          // output held back until it can be forwarded
+    size_t outputLength, outputSize;
+    int isDone;            // stdout of the replica reached EOF
+};
+
+// take the @par=N or @par=N,ordered marker out of a command's arguments (and free it)
+// returns N, 0 when the command has no marker or -1 if the marker is invalid
+int parse_parallel(char *arguments[], int *isOrdered)
+{
+    for (int i = 0; arguments[i] != NULL; i++)
     {
-        // opening /proc/{pid}/stat file
-        sprintf(statStr, "/proc/%d/stat", processInfo.si_pid);
-        statFile = fopen(statStr, "r");
-        if (statFile == NULL)
+        if (strncmp(arguments[i], "@par=", 5) != 0)
+            continue;
+
+        char *end;
+        long replicas = strtol(arguments[i] + 5, &end, 10);
+        *isOrdered = strcmp(end, ",ordered") == 0;
+        if (end == arguments[i] + 5 || (*end != '\0' && !*isOrdered) || replicas < 1 || replicas > maxReplicas)
         {
-            printf("ERROR in opening /proc/%d/stat file\n", childPID);
-            return;
+            printf("@par needs a replica count from 1 to %d (e.g. @par=4 or @par=4,ordered)\n", maxReplicas);
+            return -1;
         }
+        free(arguments[i]);
+        for (int j = i; arguments[j] != NULL; j++)
+            arguments[j] = arguments[j + 1];
+        return replicas;
+    }
+    return 0;
+}
 
-        // scanning /proc/{pid}/stat file
-        fscanf(statFile, "%d %s %c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu",
-               &pid, &foo_char, &state, &ppid, &foo_int, &foo_int, &foo_int, &foo_int,
-               (unsigned *)&foo_int, &foo_long, &foo_long, &foo_long, &foo_long,
-               &user, &sys);
-        fclose(statFile);
+// move to the next token of the command line
+void next_token(struct parser *parser)
+{
+    char *line = parser->line;
+    int length = 1;
+    // like in bash { and } are reserved only where a command starts,
+    // after a word (or << and <<<) they are arguments
+    int isArgument = parser->token == TOKEN_WORD || parser->token == TOKEN_HEREDOC || parser->token == TOKEN_HERESTRING;
+
+    free(parser->word);
+    parser->word = NULL;
+    while (*line == ' ' || *line == '\t' || *line == '\n')
+        line++;
+
+    if (*line == '\0')
+    {
+        parser->token = TOKEN_END;
+        length = 0;
+    }
+    else if (line[0] == '|' && line[1] == '|')
+    {
+        parser->token = TOKEN_OR;
+        length = 2;
+    }
+    else if (line[0] == '|' && line[1] == '>')
+    {
+        parser->token = TOKEN_FANOUT;
+        length = 2;
+    }
+    else if (line[0] == '&' && line[1] == '&')
+    {
+        parser->token = TOKEN_AND;
+        length = 2;
+    }
+    else if (line[0] == '|')
+        parser->token = TOKEN_PIPE;
+    else if (line[0] == ';')
+        parser->token = TOKEN_SEMI;
+    else if (line[0] == '(')
+        parser->token = TOKEN_LPAREN;
+    else if (line[0] == ')')
+        parser->token = TOKEN_RPAREN;
+    else if (line[0] == '<' && line[1] == '<')
+    {
+        parser->token = line[2] == '<' ? TOKEN_HERESTRING : TOKEN_HEREDOC;
+        length = line[2] == '<' ? 3 : 2;
+    }
+    else if (line[0] == '&' || line[0] == '<')
+    {
+        if (!parser->isError)
+            printf(line[0] == '&' ? "background jobs (&) are not supported\n" : "input redirection (<) is not supported\n");
+        parser->isError = 1;
+        parser->token = TOKEN_END;
+    }
+    else
+    {
+        // a word ends at a blank or an operator outside of '...' and "..."
+        char *word = malloc(strlen(line) + 1), quote = 0;
+        int wordLength = 0, isQuoted = 0;
 
-        // opening /proc/{pid}/status file
-        sprintf(statusStr, "/proc/%d/status", processInfo.si_pid);
-        statusFile = fopen(statusStr, "r");
-        if (statusFile == NULL)
+        length = 0;
+        while (line[length] != '\0' && (quote != 0 || strchr(" \t\n|&;()<", line[length]) == NULL))
         {
-            printf("ERROR in opening /proc/%d/status file\n", childPID);
-            return;
+            char c = line[length++];
+            if (quote == 0 && (c == '\'' || c == '"'))
+            {
+                quote = c;
+                isQuoted = 1;
+            }
+            else if (c == quote)
+            {
+                quote = 0;
+            }
+            else
+            {
+                word[wordLength++] = c;
+            }
         }
+        word[wordLength] = '\0';
 
-        // scanning /proc{pid}/status file
-        while (fgets(line, sizeof(line), statusFile) != NULL)
+        parser->token = TOKEN_WORD;
+        if (quote != 0)
         {
-            // read second last line
-            sscanf(line, "voluntary_ctxt_switches: %d", &vctx);
-            // read last line
-            sscanf(line, "nonvoluntary_ctxt_switches: %d", &nvctx);
+            if (!parser->isError)
+                printf("unterminated %c quote\n", quote);
+            parser->isError = 1;
+            parser->token = TOKEN_END;
+            free(word);
         }
-
-        waitpid(processInfo.si_pid, &status, 0);
-        // if normal exit
-        if (WIFEXITED(status))
+        else if (!isQuoted && wordLength == 1 && ((word[0] == '{' && !isArgument) || (word[0] == '}' && (!isArgument || parser->isInFanout))))
         {
-            printf("\n(PID)%d (CMD)%s (STATE)%c (EXCODE)%d (PPID)%d (USER)%.2ld (SYS)%.2ld (VCTX)%d (NVCTX)%d\n",
-                   pid, command, state, WEXITSTATUS(status), ppid, user, sys, vctx, nvctx);
-            // if signal exit
+            parser->token = word[0] == '{' ? TOKEN_LBRACE : TOKEN_RBRACE;
+            free(word);
         }
-        else if (WIFSIGNALED(status))
+        else
         {
-            int signum = WTERMSIG(status);
-            printf("\n(PID)%d (CMD)%s (STATE)%c (EXSIG)%s (PPID)%d (USER)%.2ld (SYS)%.2ld (VCTX)%d (NVCTX)%d\n",
-                   pid, command, state, sys_siglist[signum], ppid, user, sys, vctx, nvctx);
+            parser->word = word;
         }
     }
-    else
-    {
-        perror("waitid");
-    }
-    return;
+    parser->line = line + length;
 }
 
-int start_process()
+void syntax_error(struct parser *parser)
 {
-    signal(SIGINT, sigint_Handler);
-    signal(SIGUSR1, sigusr_Handler);
+    const char *tokens[] = {"", "|", "|>", "&&", "||", ";", "(", ")", "{", "}", "<<", "<<<", "end of line"};
 
-    char line[maxChar];
-    char *arguments[maxString];
-    char *arguments2[maxString];
-    char *arguments3[maxString];
-    char *arguments4[maxString];
-    char *arguments5[maxString];
-    char commands[maxCommands][100]; // max 5 commands
-    int numberOfCommands = 0, numberOfPipes = 0;
-    int isWrongPipe = 0;
+    if (!parser->isError)
+        printf("syntax error near %s\n", parser->token == TOKEN_WORD ? parser->word : tokens[parser->token]);
+    parser->isError = 1;
+}
 
-    // get user input
-    currPid = getpid();
-    printf("## JCshell [%d] ## ", getpid()); // print shell prompt
-    fgets(line, 1025, stdin);
+struct node *new_node(int type, struct node *left, struct node *right)
+{
+    struct node *node = calloc(1, sizeof(*node));
+
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
 
-    wrongpipe_handler(line);                                           // handle wrong pipe cases
-    parse_commands(line, &numberOfCommands, &numberOfPipes, commands); // parse user input to get commands
+void free_arguments(char **arguments)
+{
+    for (int i = 0; arguments[i] != NULL; i++)
+        free(arguments[i]);
+    free(arguments);
+}
+
+void free_node(struct node *node)
+{
+    if (node == NULL)
+        return;
 
-    // Tokenize the first command into arguments
-    int argumentCount = 0, commandLength = strlen(commands[0]);
-    char temp[100];
-    for (int i = 0; i < commandLength; i++) // remove the trailing end character
-        temp[i] = commands[0][i];
-    if (temp[commandLength - 1] == '\n')
+    free_node(node->left);
+    free_node(node->right);
+    if (node->pipeline != NULL)
     {
-        temp[commandLength - 1] = '\0'; // Replace newline character with null character
+        for (int i = 0; i < node->pipeline->numberOfCommands; i++)
+        {
+            free_arguments(node->pipeline->arguments[i]);
+            free_node(node->pipeline->units[i]);
+            if (node->pipeline->inputFds[i] >= 0)
+                close(node->pipeline->inputFds[i]);
+        }
+        for (int i = 0; i < node->pipeline->numberOfConsumers; i++)
+            free_arguments(node->pipeline->consumers[i]);
+        free(node->pipeline->arguments);
+        free(node->pipeline->units);
+        free(node->pipeline->consumers);
+        free(node->pipeline->inputFds);
+        free(node->pipeline);
     }
-    else
+    free(node);
+}
+
+int write_all(int fd, const char *data, size_t length);
+
+// put length bytes of data into a sealed memfd positioned at its start, a
+// command reading it can seek or mmap it. Returns the fd or -1
+int sealed_input(const char *data, size_t length)
+{
+    int fd = memfd_create("JCshell here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0)
     {
-        temp[commandLength] == '\0';
+        perror("memfd_create");
+        return -1;
     }
-    char *token = strtok(temp, " ");
-    while (token != NULL && argumentCount < 30)
+    if (write_all(fd, data, length) == -1)
     {
-        arguments[argumentCount++] = token;
-        token = strtok(NULL, " ");
+        perror("here-document");
+        close(fd);
+        return -1;
     }
-    arguments[argumentCount] = NULL;
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// read the lines following the command line up to delimiter into a sealed memfd
+int read_heredoc(const char *delimiter)
+{
+    char *line = NULL, *body = NULL;
+    size_t lineSize = 0, bodyLength = 0, bodySize = 0;
+    ssize_t length;
+    int fd, isTerminal = isatty(STDIN_FILENO);
 
-    // Tokenize the second command into arguments2
-    if (numberOfCommands >= 2)
+    while (1)
     {
-        int argumentCount2 = 0, commandLength2 = strlen(commands[1]);
-        char temp2[100];
-        for (int i = 0; i < commandLength2; i++)
+        if (isTerminal)
         {
-            temp2[i] = commands[1][i];
+            printf("> ");
+            fflush(stdout);
         }
-        if (temp2[commandLength2 - 1] == '\n')
+        length = getline(&line, &lineSize, stdin);
+        if (length == -1)
         {
-            temp2[commandLength2 - 1] = '\0'; // Replace newline character with null character
-        }
-        else
-        {
-            temp2[commandLength2] = '\0';
+            printf("here-document ended by end of input (wanted %s)\n", delimiter);
+            break;
         }
+        if (strcspn(line, "\n") == strlen(delimiter) && strncmp(line, delimiter, strlen(delimiter)) == 0)
+            break;
 
-        char *token2 = strtok(temp2, " ");
-        while (token2 != NULL && argumentCount2 < 30)
+        if (bodyLength + length > bodySize)
         {
-            arguments2[argumentCount2++] = token2;
-            token2 = strtok(NULL, " ");
+            bodySize = 2 * (bodyLength + length);
+            body = realloc(body, bodySize);
         }
-        arguments2[argumentCount2] = NULL;
+        memcpy(body + bodyLength, line, length);
+        bodyLength += length;
     }
+    fd = sealed_input(body, bodyLength);
+    free(line);
+    free(body);
+    return fd;
+}
 
-    // Tokenize the third command into arguments3
-    if (numberOfCommands >= 3)
-    {
+// read the words of one command into a new argument vector for execvp.
+// A <<EOF or <<< word gives the command a here-document in *inputFd,
+// where inputFd is NULL the command cannot have one
+char **parse_words(struct parser *parser, int *inputFd)
+{
+    char **arguments = calloc(maxString, sizeof(char *));
+    int argumentCount = 0;
 
-        int argumentCount3 = 0, commandLength3 = strlen(commands[2]);
-        char temp3[100];
-        for (int i = 0; i < commandLength3; i++)
-        {
-            temp3[i] = commands[2][i];
-        }
-        if (temp3[commandLength3 - 1] == '\n')
+    while (parser->token == TOKEN_WORD || parser->token == TOKEN_HEREDOC || parser->token == TOKEN_HERESTRING)
+    {
+        if (parser->token != TOKEN_WORD)
         {
-            temp3[commandLength3 - 1] = '\0'; // Replace newline character with null character
+            int isString = parser->token == TOKEN_HERESTRING;
+
+            next_token(parser);
+            if (parser->token != TOKEN_WORD)
+            {
+                syntax_error(parser);
+                break;
+            }
+            if (inputFd == NULL || *inputFd >= 0)
+            {
+                printf(inputFd == NULL ? "fan-out consumers cannot have a here-document\n" : "a command can have only one here-document\n");
+                parser->isError = 1;
+                break;
+            }
+            if (isString)
+            {
+                size_t length = strlen(parser->word);
+                parser->word[length] = '\n'; // bash ends a here-string with a newline
+                *inputFd = sealed_input(parser->word, length + 1);
+                parser->word[length] = '\0';
+            }
+            else
+            {
+                *inputFd = read_heredoc(parser->word);
+            }
+            if (*inputFd < 0)
+            {
+                parser->isError = 1;
+                break;
+            }
         }
-        else
+        else if (argumentCount < maxString - 1)
         {
-            temp3[commandLength3] = '\0';
+            arguments[argumentCount++] = parser->word;
+            parser->word = NULL;
         }
-
-        char *token3 = strtok(temp3, " ");
-        while (token3 != NULL && argumentCount3 < 30)
+        next_token(parser);
+    }
+    if (argumentCount == 0 || parser->isError)
+    {
+        free_arguments(arguments);
+        syntax_error(parser);
+        if (inputFd != NULL && *inputFd >= 0)
         {
-            arguments3[argumentCount3++] = token3;
-            token3 = strtok(NULL, " ");
+            close(*inputFd);
+            *inputFd = -1;
         }
-        arguments3[argumentCount3] = NULL;
+        return NULL;
     }
+    return arguments;
+}
 
-    // Tokenize the fourth command into arguments4
-    if (numberOfCommands >= 4)
+struct node *parse_group(struct parser *parser);
+
+// pipeline := stage ('|' stage)* ['|>' '{' command (';' command)* '}']
+// stage := '(' list ')' | '{' list '}' | command
+// a lone ( ) or { } is returned as it is, not as a pipeline
+struct node *parse_pipeline(struct parser *parser)
+{
+    struct node *node = new_node(NODE_PIPELINE, NULL, NULL);
+    struct pipeline *pipeline = calloc(1, sizeof(*pipeline));
+
+    node->pipeline = pipeline;
+    pipeline->arguments = calloc(maxCommands, sizeof(char **));
+    pipeline->units = calloc(maxCommands, sizeof(struct node *));
+    pipeline->consumers = calloc(maxCommands, sizeof(char **));
+    pipeline->inputFds = malloc(maxCommands * sizeof(int));
+    for (int i = 0; i < maxCommands; i++)
+        pipeline->inputFds[i] = -1;
+    pipeline->parallelStage = -1;
+    pipeline->outputFd = -1;
+    pipeline->timeout = defaultTimeout;
+
+    while (!parser->isError)
     {
-        int argumentCount4 = 0, commandLength4 = strlen(commands[3]);
-        char temp4[100];
-        for (int i = 0; i < commandLength4; i++)
+        if (pipeline->numberOfCommands == maxCommands)
         {
-            temp4[i] = commands[3][i];
+            printf("JCshell cannot accept more than 5 commands!\n");
+            parser->isError = 1;
+            break;
         }
-        if (temp4[commandLength4 - 1] == '\n')
+        char **arguments;
+        if (parser->token == TOKEN_LPAREN || parser->token == TOKEN_LBRACE)
         {
-            temp4[commandLength4 - 1] = '\0'; // Replace newline character with null character
+            struct node *unit = parse_group(parser);
+            if (unit == NULL)
+            {
+                parser->isError = 1;
+                break;
+            }
+            pipeline->units[pipeline->numberOfCommands] = unit;
+            arguments = calloc(maxString, sizeof(char *)); // only names the stage
+            arguments[0] = strdup(unit->type == NODE_SUBSHELL ? "(subshell)" : "{group}");
         }
         else
         {
-            temp4[commandLength4] = '\0';
+            arguments = parse_words(parser, &pipeline->inputFds[pipeline->numberOfCommands]);
         }
+        if (arguments == NULL)
+            break;
+        pipeline->arguments[pipeline->numberOfCommands++] = arguments;
 
-        char *token4 = strtok(temp4, " ");
-        while (token4 != NULL && argumentCount4 < 30)
+        // cmd @par=N runs N replicas of one stage
+        int replicas = parse_parallel(arguments, &pipeline->isOrdered);
+        if (replicas == -1)
+        {
+            parser->isError = 1;
+            break;
+        }
+        if (replicas > 0 && (pipeline->numberOfCommands == 1 || pipeline->parallelStage >= 0 || arguments[0] == NULL ||
+                             pipeline->inputFds[pipeline->numberOfCommands - 1] >= 0))
         {
-            arguments4[argumentCount4++] = token4;
-            token4 = strtok(NULL, " ");
+            printf("@par is allowed on one command after a pipe and not with |> or a here-document\n");
+            parser->isError = 1;
+            break;
         }
-        arguments4[argumentCount4] = NULL;
+        if (replicas > 0)
+        {
+            pipeline->parallelStage = pipeline->numberOfCommands - 1;
+            pipeline->numberOfReplicas = replicas;
+        }
+
+        if (parser->token != TOKEN_PIPE)
+            break;
+        next_token(parser);
     }
 
-    // Tokenize the fifth command into arguments5
-    if (numberOfCommands == 5)
+    // producer |> { consumerA ; consumerB }
+    if (!parser->isError && parser->token == TOKEN_FANOUT)
     {
-        int argumentCount5 = 0, commandLength5 = strlen(commands[4]);
-        char temp5[100];
-        for (int i = 0; i < commandLength5; i++)
-        {
-            temp5[i] = commands[4][i];
-        }
-        if (temp5[commandLength5 - 1] == '\n')
+        next_token(parser);
+        parser->isInFanout = 1;
+        if (parser->token != TOKEN_LBRACE || pipeline->parallelStage >= 0)
         {
-            temp5[commandLength5 - 1] = '\0'; // Replace newline character with null character
+            printf("|> must be followed by { consumer ; consumer } and not used with @par\n");
+            parser->isError = 1;
         }
         else
         {
-            temp5[commandLength5] = '\0';
+            next_token(parser);
         }
 
-        char *token5 = strtok(temp5, " ");
-        while (token5 != NULL && argumentCount5 < 30)
+        while (!parser->isError && parser->token != TOKEN_RBRACE)
+        {
+            if (parser->token == TOKEN_SEMI)
+            {
+                next_token(parser);
+                continue;
+            }
+            if (pipeline->numberOfConsumers == maxCommands)
+            {
+                printf("JCshell cannot fan out to more than 5 commands!\n");
+                parser->isError = 1;
+                break;
+            }
+            char **consumer = parse_words(parser, NULL);
+            if (consumer == NULL)
+                break;
+            pipeline->consumers[pipeline->numberOfConsumers++] = consumer;
+            if (parser->token == TOKEN_PIPE)
+            {
+                printf("fan-out consumers must be single commands\n");
+                parser->isError = 1;
+            }
+        }
+        if (!parser->isError && pipeline->numberOfConsumers == 0)
         {
-            arguments5[argumentCount5++] = token5;
-            token5 = strtok(NULL, " ");
+            printf("|> needs at least one consumer\n");
+            parser->isError = 1;
         }
-        arguments5[argumentCount5] = NULL;
+        parser->isInFanout = 0;
+        if (!parser->isError)
+            next_token(parser);
     }
-    // exit handling
-    if ((numberOfCommands > 1 || argumentCount > 1) && strcmp(arguments[0], "exit") == 0)
+
+    if (parser->isError)
     {
-        isSkip = 1;
-        printf("exit with extra arguments!!!\n");
+        free_node(node);
+        return NULL;
     }
-    else if (strcmp(arguments[0], "exit") == 0)
+    if (pipeline->numberOfCommands == 1 && pipeline->numberOfConsumers == 0 && pipeline->units[0] != NULL)
     {
-        isSkip = 1;
-        kill(0, SIGTERM);
-        exit(0);
+        struct node *unit = pipeline->units[0];
+        pipeline->units[0] = NULL;
+        free_node(node);
+        return unit;
     }
+    return node;
+}
 
-    // Create a child process to execute the command
-    // when there is just one command
-    if (numberOfCommands == 1 && isSkip == 0)
+struct node *parse_list(struct parser *parser, int terminator);
+
+// group := '(' list ')' | '{' list '}'
+struct node *parse_group(struct parser *parser)
+{
+    int type = parser->token == TOKEN_LPAREN ? NODE_SUBSHELL : NODE_GROUP;
+    int closing = parser->token == TOKEN_LPAREN ? TOKEN_RPAREN : TOKEN_RBRACE;
+
+    next_token(parser);
+    struct node *inner = parse_list(parser, closing);
+    if (inner == NULL)
+        return NULL;
+    if (parser->token != closing)
     {
-        // signal(SIGINT, sigint_Handler);
+        syntax_error(parser);
+        free_node(inner);
+        return NULL;
+    }
+    next_token(parser);
+    return new_node(type, inner, NULL);
+}
 
-        pid_t pid = fork();
+// and_or := pipeline (('&&' | '||') pipeline)*
+struct node *parse_and_or(struct parser *parser)
+{
+    struct node *node = parse_pipeline(parser);
 
-        if (pid < 0)
-        {
-            printf("Fork failed");
-        }
-        else if (pid == 0) // Child Process
+    while (node != NULL && (parser->token == TOKEN_AND || parser->token == TOKEN_OR))
+    {
+        int type = parser->token == TOKEN_AND ? NODE_AND : NODE_OR;
+        next_token(parser);
+        struct node *right = parse_pipeline(parser);
+        if (right == NULL)
         {
-            signal(SIGUSR1, sigusr_Handler);
-            signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-            int execReturn = execvp(arguments[0], arguments);
-            if (execReturn == -1)
-            {
-                perror("execvp"); // Print error if execvp fails
-            }
+            free_node(node);
+            return NULL;
         }
-        else
-        {
-            // wait(NULL);
-            signal(SIGUSR1, sigusr_Handler);
-            signal(SIGINT, sigint_Handler);
+        node = new_node(type, node, right);
+    }
+    return node;
+}
 
-            int childStatus;
-            siginfo_t processInfo;
-            kill(pid, SIGUSR1);
-            // waitpid(processInfo.si_pid, &childStatus, 0);
+// list := and_or (';' and_or)* [';'], ends in front of the terminator token
+struct node *parse_list(struct parser *parser, int terminator)
+{
+    struct node *node = parse_and_or(parser);
 
-            // Wait for a short duration to ensure the files are available
-            // usleep(10000);
-            getProcessStatistics(pid, commands[0], childStatus);
+    while (node != NULL && parser->token == TOKEN_SEMI)
+    {
+        next_token(parser);
+        if (parser->token == terminator)
+            break;
+        struct node *right = parse_and_or(parser);
+        if (right == NULL)
+        {
+            free_node(node);
+            return NULL;
         }
+        node = new_node(NODE_SEQUENCE, node, right);
     }
+    return node;
+}
 
-    // one pipe
-    if (numberOfCommands == 2 && isSkip == 0)
+// parse user input into a tree of pipelines joined by ; && || ( ) { }
+// returns NULL for an empty line or after printing a syntax error
+struct node *parse_commands(char *line)
+{
+    struct parser parser = {line, TOKEN_END, NULL, 0, 0};
+    struct node *commandLine = NULL;
+
+    next_token(&parser);
+    if (parser.token != TOKEN_END)
     {
-        int fd[2];
-        pipe(fd);
-        if (pipe(fd) == -1)
+        commandLine = parse_list(&parser, TOKEN_END);
+        if (commandLine != NULL && parser.token != TOKEN_END)
         {
-            printf("Pipe Failed. Try Again");
-            return 0;
+            syntax_error(&parser);
+            free_node(commandLine);
+            commandLine = NULL;
         }
+    }
+    free(parser.word);
+    return commandLine;
+}
+
+void sigint_Handler(int sigint)
+{
+    // child process handles in default way, otherwise this
+    //  JCshell process handling SIGINT
+    if (jobGroup > 0) // a job in its own process group does not get it from the terminal
+        kill(-jobGroup, SIGINT);
+    printf("\n## JCshell [%d] ## ", currPid);
+    fflush(stdout);
+}
 
-        pid_t pid1;
-        pid_t pid2;
+void sigusr_Handler(int sigusr1)
+{
+    sleep(0.5);
+}
 
-        pid1 = fork();
-        if (pid1 < 0)
-        {
-            printf("Fork failed");
-        }
-        else if (pid1 == 0) // Child Process 1
-        {
-            dup2(fd[1], STDOUT_FILENO);
-            close(fd[0]);
-            close(fd[1]);
-            signal(SIGUSR1, sigusr_Handler);
-            signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-            int execReturn = execvp(arguments[0], arguments);
-            if (execReturn == -1)
-            {
-                perror("execvp"); // Print error if execvp fails
-            }
-        }
-        else
+// note the exit time of every child of the job that has just exited. The
+// shell may be busy pumping a fan-out or @par stage for a long time before
+// it collects a child, this keeps that wait out of wall times and traces
+void sigchld_Handler(int sigchld)
+{
+    int savedErrno = errno;
+    siginfo_t info;
+
+    for (int i = 0; i < numberOfWatched; i++)
+    {
+        if (exitTimes[i] != 0)
+            continue;
+        info.si_pid = 0;
+        if (waitid(P_PID, watchedPids[i], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0)
+            exitTimes[i] = monotonic_us();
+    }
+    errno = savedErrno;
+}
+
+// read a whole /proc/{pid}/{name} file with one read() into buffer
+// returns its length, or -1 if the file cannot be read
+int read_proc_file(pid_t pid, const char *name, char *buffer, int size)
+{
+    char path[64];
+    int fd, length;
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length < 0)
+        return -1;
+    buffer[length] = '\0';
+    return length;
+}
+
+// parse the number at *cursor and move past it, negative numbers give 0
+unsigned long long next_number(char **cursor)
+{
+    char *p = *cursor;
+    unsigned long long value = 0;
+    int isNegative;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    isNegative = *p == '-';
+    p += isNegative;
+    while (*p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    *cursor = p;
+    return isNegative ? 0 : value;
+}
+
+// parse /proc/{pid}/stat. comm may hold spaces and ')' itself, but the
+// kernel keeps it under 16 bytes, so its end is the last ')' in that range
+int parse_stat(char *buffer, int length, struct processStats *stats)
+{
+    char *cursor = buffer, *openParen, *closeParen;
+
+    stats->pid = next_number(&cursor);
+    openParen = memchr(cursor, '(', length - (cursor - buffer));
+    if (openParen == NULL)
+        return -1;
+    closeParen = memrchr(openParen, ')', length - (openParen - buffer) < 17 ? length - (openParen - buffer) : 17);
+    if (closeParen == NULL || closeParen[1] != ' ')
+        return -1;
+
+    stats->state = closeParen[2];
+    cursor = closeParen + 3;
+    stats->ppid = next_number(&cursor);
+    for (int i = 0; i < 9; i++) // pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt
+        next_number(&cursor);
+    stats->user = next_number(&cursor);
+    stats->sys = next_number(&cursor);
+    return 0;
+}
+
+// one pass over the "name: value" lines of /proc/{pid}/status or io,
+// values[i] gets the value of names[i] (and is left alone if it is missing)
+void parse_fields(char *buffer, const char *names[], unsigned long long values[], int count)
+{
+    for (char *line = buffer; *line != '\0';)
+    {
+        for (int i = 0; i < count; i++)
         {
-            pid2 = fork();
-            if (pid2 < 0)
-            {
-                printf("Fork failed");
-            }
-            else if (pid2 == 0) // Child Process 2
+            int length = strlen(names[i]);
+            if (line[0] == names[i][0] && strncmp(line, names[i], length) == 0 && line[length] == ':')
             {
-                dup2(fd[0], STDIN_FILENO);
-                close(fd[0]);
-                close(fd[1]);
-                signal(SIGUSR1, sigusr_Handler);
-                signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                int execReturn = execvp(arguments2[0], arguments2);
-                if (execReturn == -1)
-                {
-                    perror("execvp"); // Print error if execvp fails
-                }
+                char *cursor = line + length + 1;
+                values[i] = next_number(&cursor);
+                break;
             }
         }
-        close(fd[0]);
-        close(fd[1]);
-
-        signal(SIGUSR1, sigusr_Handler);
-        signal(SIGINT, sigint_Handler);
+        line = strchr(line, '\n');
+        if (line == NULL)
+            break;
+        line++;
+    }
+}
 
-        int childStatus1, childStatus2;
-        kill(pid1, SIGUSR1);
-        kill(pid2, SIGUSR1);
+// state, times and context switches of a (zombie) process from its stat and status files
+// returns NULL, or the name of the file that could not be read
+const char *read_base_metrics(pid_t pid, struct processStats *stats)
+{
+    const char *statusNames[] = {"voluntary_ctxt_switches", "nonvoluntary_ctxt_switches"};
+    unsigned long long values[2] = {0, 0};
+    char buffer[4096];
+    int length;
+
+    length = read_proc_file(pid, "stat", buffer, sizeof(buffer));
+    if (length < 0 || parse_stat(buffer, length, stats) == -1)
+        return "stat";
+    if (read_proc_file(pid, "status", buffer, sizeof(buffer)) < 0)
+        return "status";
+    parse_fields(buffer, statusNames, values, 2);
+    stats->vctx = values[0];
+    stats->nvctx = values[1];
+    return NULL;
+}
 
-        getProcessStatistics(pid1, commands[0], childStatus1);
-        getProcessStatistics(pid2, commands[1], childStatus2);
+// io and run-queue delay of a process, both still readable while it is a zombie
+void read_extended_metrics(pid_t pid, struct processStats *stats)
+{
+    const char *ioNames[] = {"rchar", "wchar", "read_bytes", "write_bytes"};
+    unsigned long long values[4] = {0, 0, 0, 0};
+    char buffer[4096];
+
+    if (read_proc_file(pid, "io", buffer, sizeof(buffer)) > 0)
+        parse_fields(buffer, ioNames, values, 4);
+    stats->rchar = values[0];
+    stats->wchar = values[1];
+    stats->readBytes = values[2];
+    stats->writeBytes = values[3];
+
+    if (read_proc_file(pid, "schedstat", buffer, sizeof(buffer)) > 0)
+    {
+        char *cursor = buffer;
+        next_number(&cursor); // time on cpu
+        stats->runDelay = next_number(&cursor);
     }
+}
 
-    // two pipes
-    if (numberOfCommands == 3 && isSkip == 0)
-    {
-        int fd[4];
-        pipe(fd);
-        pipe(fd + 2);
-        if (pipe(fd) == -1 || pipe(fd + 2) == -1)
-        {
-            printf("Pipe Failed. Try Again");
-            return 0;
-        }
+// wait for whichever child of the job terminates next and print its statistics
+// returns the index of that child in childPIDs, or -1 if nothing was reaped
+// (exitTimes[] of that child is filled in if the exit went unnoticed)
+int getProcessStatistics(pid_t childPIDs[], char *commands[], long long forkTimes[], long long exitTimes[], int numberOfChildren, struct processStats *stats)
+{
+    int status, child = -1;
+    char traceArgs[100];
+    const char *failed;
+    char *command = "";
 
-        pid_t pid1;
-        pid_t pid2;
-        pid_t pid3;
+    siginfo_t processInfo;
+    struct rusage usage;
 
-        pid1 = fork();
-        if (pid1 < 0)
-        {
-            printf("Fork failed");
-        }
-        else if (pid1 == 0) // Child Process 1
+    memset(stats, 0, sizeof(*stats));
+    int ret = waitid(P_ALL, 0, &processInfo, WNOWAIT | WEXITED);
+    if (!ret)
+    {
+        long long collectTime = trace_now(), exitTime = collectTime;
+        for (int i = 0; i < numberOfChildren; i++)
         {
-            close(fd[2]);
-            close(fd[3]);
-            dup2(fd[1], STDOUT_FILENO);
-            close(fd[0]);
-            close(fd[1]);
-
-            signal(SIGUSR1, sigusr_Handler);
-            signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-            int execReturn = execvp(arguments[0], arguments);
-            if (execReturn == -1)
+            if (childPIDs[i] == processInfo.si_pid)
             {
-                perror("execvp"); // Print error if execvp fails
+                child = i;
+                command = commands[i];
+                if (exitTimes[i] == 0)
+                    exitTimes[i] = monotonic_us();
+                exitTime = trace_time(exitTimes[i]);
             }
         }
-        else
+
+        // reading /proc/{pid}/stat and /proc/{pid}/status files
+        failed = read_base_metrics(processInfo.si_pid, stats);
+        if (failed != NULL)
         {
-            pid2 = fork();
-            if (pid2 < 0)
-            {
-                printf("Fork failed");
-            }
-            else if (pid2 == 0) // Child Process 2
-            {
-                close(fd[1]);
-                dup2(fd[0], STDIN_FILENO);
-                close(fd[2]);
-                dup2(fd[3], STDOUT_FILENO);
-                close(fd[0]);
-                close(fd[3]);
+            printf("ERROR in opening /proc/%d/%s file\n", processInfo.si_pid, failed);
+            waitpid(processInfo.si_pid, &status, 0);
+            return child;
+        }
+        if (isExtendedMetrics)
+            read_extended_metrics(processInfo.si_pid, stats);
 
-                signal(SIGUSR1, sigusr_Handler);
-                signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                int execReturn = execvp(arguments2[0], arguments2);
-                if (execReturn == -1)
-                {
-                    perror("execvp"); // Print error if execvp fails
-                }
-            }
-            else
+        wait4(processInfo.si_pid, &status, 0, &usage);
+        stats->status = status;
+        stats->maxRss = usage.ru_maxrss;
+
+        // if normal exit
+        if (WIFEXITED(status))
+        {
+            printf("\n(PID)%d (CMD)%s (STATE)%c (EXCODE)%d (PPID)%d (USER)%.2ld (SYS)%.2ld (VCTX)%d (NVCTX)%d",
+                   stats->pid, command, stats->state, WEXITSTATUS(status), stats->ppid, stats->user, stats->sys, stats->vctx, stats->nvctx);
+            sprintf(traceArgs, "{\"excode\":%d}", WEXITSTATUS(status));
+            // if signal exit
+        }
+        else if (WIFSIGNALED(status))
+        {
+            int signum = WTERMSIG(status);
+            printf("\n(PID)%d (CMD)%s (STATE)%c (EXSIG)%s (PPID)%d (USER)%.2ld (SYS)%.2ld (VCTX)%d (NVCTX)%d",
+                   stats->pid, command, stats->state, strsignal(signum), stats->ppid, stats->user, stats->sys, stats->vctx, stats->nvctx);
+            sprintf(traceArgs, "{\"exsig\":%d}", signum);
+        }
+        // whatever the way out, also a stage that traps SIGTERM and exits 0
+        stats->isTimedOut = deadlineStage > 0 && (child < 0 || exitTimes[child] >= deadlineTime);
+        if (stats->isTimedOut)
+            printf(" (TIMEOUT)%.2fs", jobTimeout);
+        if (isExtendedMetrics)
+        {
+            printf(" (RCHAR)%llu (WCHAR)%llu (RBYTES)%llu (WBYTES)%llu (MAXRSS)%ldkB (RUNQ)%lluus",
+                   stats->rchar, stats->wchar, stats->readBytes, stats->writeBytes, stats->maxRss, stats->runDelay / 1000);
+        }
+        printf("\n");
+
+        if (child >= 0)
+        {
+            trace_event("run", 'X', processInfo.si_pid, forkTimes[child], exitTime - forkTimes[child], NULL);
+            trace_event("exit", 'i', processInfo.si_pid, exitTime, 0, traceArgs);
+        }
+        trace_event("stats", 'X', currPid, collectTime, trace_now() - collectTime, NULL);
+    }
+    else
+    {
+        perror("waitid");
+    }
+    return child;
+}
+
+// seconds in a duration like 30, 30s, 500ms, 2m or 1.5h, -1 if it is not one
+double parse_duration(const char *text)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+
+    if (unit == text || !(value >= 0 && value < 1e8))
+        return -1;
+    if (strcmp(unit, "") == 0 || strcmp(unit, "s") == 0)
+        return value;
+    if (strcmp(unit, "ms") == 0)
+        return value / 1000;
+    if (strcmp(unit, "m") == 0)
+        return value * 60;
+    if (strcmp(unit, "h") == 0)
+        return value * 3600;
+    return -1;
+}
+
+// make deadlineFd fire in seconds, 0 disarms it
+void arm_deadline(double seconds)
+{
+    struct itimerspec timer = {{0, 0}, {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)}};
+
+    if (seconds > 0 && timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+        timer.it_value.tv_nsec = 1; // 0 would disarm
+    timerfd_settime(deadlineFd, 0, &timer, NULL);
+}
+
+// deadlineFd is readable: SIGTERM the job's process group, and SIGKILL it
+// if it is still around killGrace seconds later
+void deadline_expired()
+{
+    unsigned long long expirations;
+    char traceArgs[32];
+    int signum = deadlineStage == 0 ? SIGTERM : SIGKILL;
+
+    if (read(deadlineFd, &expirations, sizeof(expirations)) != sizeof(expirations) || deadlineStage == 2)
+        return;
+    if (signum == SIGTERM)
+        deadlineTime = monotonic_us();
+    kill(-jobGroup, signum);
+    deadlineStage++;
+    if (signum == SIGTERM)
+        arm_deadline(killGrace);
+    sprintf(traceArgs, "{\"signal\":%d}", signum);
+    trace_event("timeout", 'i', currPid, trace_now(), 0, traceArgs);
+}
+
+// with a deadline, wait until a child of the job has terminated while
+// watching the timer, so a hung stage cannot block getProcessStatistics().
+// SIGCHLD is blocked except inside ppoll(), so an exit between the check
+// and the ppoll() still interrupts it
+void wait_for_child()
+{
+    struct pollfd timer = {deadlineFd, POLLIN, 0};
+    sigset_t chldMask, originalMask, waitMask;
+    siginfo_t info;
+
+    sigemptyset(&chldMask);
+    sigaddset(&chldMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chldMask, &originalMask);
+    waitMask = originalMask;
+    sigdelset(&waitMask, SIGCHLD);
+    while (1)
+    {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid != 0)
+            break; // a child to collect, or none left
+        if (ppoll(&timer, 1, NULL, &waitMask) == -1 && errno != EINTR)
+        {
+            perror("ppoll");
+            break;
+        }
+        if (timer.revents)
+            deadline_expired();
+    }
+    sigprocmask(SIG_SETMASK, &originalMask, NULL);
+}
+
+int run_node(struct node *node, int *ran);
+
+// in the child of a ( ) or { } pipeline stage: run unit with inFd/outFd as
+// the stdin/stdout of its commands, the statistics still go to the shell's
+// stdout. The child does not exec, so the other pipe ends of the job have to
+// be closed by hand or the stages next to it would never see EOF
+void run_unit(struct node *unit, int inFd, int outFd)
+{
+    int ran = 0, status;
+
+    for (int i = 0; i < numberOfJobPipes; i++)
+    {
+        if (jobPipes[i] != inFd && jobPipes[i] != outFd)
+            close(jobPipes[i]);
+    }
+    numberOfJobPipes = 0;
+    numberOfWatched = 0; // the children of the pipeline belong to the shell running it
+    if (inFd >= 0)
+        stageInput = inFd;
+    if (outFd >= 0)
+        stageOutput = outFd;
+    if (deadlineFd >= 0) // the deadline belongs to the shell running the pipeline
+        close(deadlineFd);
+    deadlineFd = -1;
+    jobGroup = 0;
+    isSubshell = 1;
+    currPid = getpid();
+
+    status = run_node(unit, &ran);
+    fflush(stdout);
+    _exit(status);
+}
+
+// fork a stage and leave it waiting for SIGUSR1 before it runs arguments
+// (or unit if that is not NULL), its stdin/stdout are moved onto inFd/outFd
+// (-1 keeps the shell's own).
+// group < 0 keeps the child in the shell's process group, 0 makes it the
+// leader of a new one and > 0 puts it into that group
+pid_t start_stage(char *arguments[], struct node *unit, int inFd, int outFd, sigset_t *waitMask, pid_t group)
+{
+    pid_t pid = fork();
+    if (pid > 0 && group >= 0)
+        setpgid(pid, group > 0 ? group : pid); // in both processes, whichever runs first
+    if (pid != 0)
+        return pid;
+
+    // Child Process
+    long long childStart = trace_now();
+    if (group >= 0)
+        setpgid(0, group);
+    if (inFd >= 0 && unit == NULL)
+        dup2(inFd, STDIN_FILENO);
+    if (outFd >= 0 && unit == NULL)
+        dup2(outFd, STDOUT_FILENO);
+    signal(SIGUSR1, sigusr_Handler);
+    signal(SIGINT, SIG_DFL); // child command handles with default behaviour
+    sigsuspend(waitMask);
+    sigprocmask(SIG_SETMASK, waitMask, NULL);
+
+    if (unit != NULL)
+        run_unit(unit, inFd, outFd);
+
+    trace_event("exec", 'X', getpid(), childStart, trace_now() - childStart, NULL);
+    execvp(arguments[0], arguments);
+    perror("execvp"); // Print error if execvp fails
+    _exit(127);
+}
+
+// create numberOfPipes close-on-exec pipes in fd, nothing is left open on failure
+int open_pipes(int fd[], int numberOfPipes)
+{
+    for (int i = 0; i < numberOfPipes; i++)
+    {
+        if (pipe2(fd + 2 * i, O_CLOEXEC) == -1)
+        {
+            printf("Pipe Failed. Try Again");
+            for (int j = 0; j < 2 * i; j++)
+                close(fd[j]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// move len bytes from the pipe in to every consumer in outs. tee() duplicates
+// the bytes into the first consumer without consuming them, splice() then
+// moves the same bytes into a relay pipe that feeds the remaining consumers,
+// so the data is never copied through user space. One tee() moves at most
+// relaySize bytes, the room of the smallest (empty) relay, so the splice()
+// into a relay can never block. A consumer that went away is closed and set
+// to -1, the last level drains into devNull instead
+int fanout_forward(int in, int outs[], int relays[], int numberOfOutputs, ssize_t len, int devNull, int relaySize)
+{
+    while (len > 0)
+    {
+        ssize_t moved;
+
+        if (numberOfOutputs == 1)
+        {
+            moved = splice(in, NULL, outs[0] >= 0 ? outs[0] : devNull, NULL, len, SPLICE_F_MOVE);
+        }
+        else if (outs[0] < 0)
+        {
+            return fanout_forward(in, outs + 1, relays + 2, numberOfOutputs - 1, len, devNull, relaySize);
+        }
+        else
+        {
+            moved = tee(in, outs[0], len < relaySize ? len : relaySize, 0);
+            if (moved > 0)
             {
-                close(fd[0]);
-                close(fd[1]);
-                pid3 = fork();
-                if (pid3 < 0)
-                {
-                    printf("Fork failed");
-                }
-                else if (pid3 == 0) // Child Process 3
+                for (ssize_t left = moved; left > 0;)
                 {
-                    close(fd[3]);
-                    dup2(fd[2], STDIN_FILENO);
-                    close(fd[2]);
-
-                    signal(SIGUSR1, sigusr_Handler);
-                    signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                    int execReturn = execvp(arguments3[0], arguments3);
-                    if (execReturn == -1)
+                    ssize_t relayed = splice(in, NULL, relays[1], NULL, left, SPLICE_F_MOVE);
+                    if (relayed < 0 && errno != EINTR)
                     {
-                        perror("execvp"); // Print error if execvp fails
+                        perror("splice");
+                        return -1;
                     }
+                    if (relayed > 0)
+                        left -= relayed;
                 }
+                if (fanout_forward(relays[0], outs + 1, relays + 2, numberOfOutputs - 1, moved, devNull, relaySize) == -1)
+                    return -1;
             }
         }
 
-        close(fd[0]);
-        close(fd[1]);
-        close(fd[2]);
-        close(fd[3]);
-        signal(SIGUSR1, sigusr_Handler);
-        signal(SIGINT, sigint_Handler);
+        if (moved < 0 && errno == EPIPE) // consumer exited early
+        {
+            close(outs[0]);
+            outs[0] = -1;
+            continue;
+        }
+        if (moved < 0 && errno != EINTR)
+        {
+            perror(numberOfOutputs == 1 ? "splice" : "tee");
+            return -1;
+        }
+        if (moved > 0)
+            len -= moved;
+    }
+    return 0;
+}
+
+// feed everything the producer writes into fanIn to every consumer in outs
+// until the producer closes its end or no consumer is left
+void fanout_pump(int fanIn, int outs[], int relays[], int relaySize, int numberOfConsumers, pid_t producer, pid_t consumers[])
+{
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC), available, isFirst = 1;
+    struct pollfd fds[2] = {{fanIn, POLLIN, 0}, {deadlineFd, POLLIN, 0}}; // poll() skips a -1 deadlineFd
+
+    signal(SIGPIPE, SIG_IGN); // a consumer exiting early must not kill the shell
+    while (1)
+    {
+        int live = 0;
+        for (int i = 0; i < numberOfConsumers; i++)
+            live += outs[i] >= 0;
+        if (live == 0)
+            break;
+
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents)
+            deadline_expired();
+        if (ioctl(fanIn, FIONREAD, &available) == -1 || available == 0)
+        {
+            if (fds[0].revents & POLLHUP) // producer finished
+                break;
+            continue;
+        }
+
+        if (isFirst)
+        {
+            long long now = trace_now();
+            trace_event("first byte", 'i', producer, now, 0, NULL);
+            for (int i = 0; i < numberOfConsumers; i++)
+                trace_event("first byte", 'i', consumers[i], now, 0, NULL);
+            isFirst = 0;
+        }
+        if (fanout_forward(fanIn, outs, relays, numberOfConsumers, available, devNull, relaySize) == -1)
+            break;
+    }
+    signal(SIGPIPE, SIG_DFL);
+    close(devNull);
+}
 
-        int childStatus1, childStatus2, childStatus3;
-        kill(pid1, SIGUSR1);
-        kill(pid2, SIGUSR1);
-        kill(pid3, SIGUSR1);
+// write all of data to a blocking descriptor, -1 once the reader is gone
+int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
 
-        getProcessStatistics(pid1, commands[0], childStatus1);
-        getProcessStatistics(pid2, commands[1], childStatus2);
-        getProcessStatistics(pid3, commands[2], childStatus3);
+// keep output of a replica until it can be forwarded
+void hold_output(struct replica *replica, const char *data, size_t length)
+{
+    if (replica->outputLength + length > replica->outputSize)
+    {
+        replica->outputSize = 2 * (replica->outputLength + length);
+        replica->output = realloc(replica->output, replica->outputSize);
     }
+    memcpy(replica->output + replica->outputLength, data, length);
+    replica->outputLength += length;
+}
 
-    // three pipes
-    if (numberOfCommands == 4 && isSkip == 0)
+// split the stream coming from upstream across the replicas of a parallel
+// stage and merge their outputs into downstream.
+// streaming mode hands line-aligned chunks to whichever replica is idle and
+// forwards only complete output lines, so lines of different replicas never
+// mix. ordered mode has to read the whole input first: every replica gets
+// one contiguous line-aligned part and the outputs go out in replica order
+void parallel_pump(int upstream, int downstream, struct replica replicas[], int numberOfReplicas, int isOrdered)
+{
+    size_t inputSize = 2 * parChunk, inputLength = 0;
+    char *input = malloc(inputSize), buffer[parChunk];
+    int head = 0, next = 0; // head: ordered replica whose output goes out now
+    struct pollfd fds[2 + 2 * numberOfReplicas];
+    int owner[2 + 2 * numberOfReplicas];
+
+    signal(SIGPIPE, SIG_IGN); // replicas or the next stage may exit early
+    while (1)
     {
-        int fd[6];
-        pipe(fd);
-        pipe(fd + 2);
-        pipe(fd + 4);
-        if (pipe(fd) == -1 || pipe(fd + 2) == -1 || pipe(fd + 4) == -1)
+        // streaming: hand out complete lines to idle replicas
+        for (int tries = 0; !isOrdered && inputLength > 0 && tries < numberOfReplicas; tries++)
         {
-            printf("Pipe Failed. Try Again");
-            return 0;
+            struct replica *replica = &replicas[next];
+            next = (next + 1) % numberOfReplicas;
+            if (replica->inFd < 0 || replica->pendingLength > 0)
+                continue;
+
+            size_t length = inputLength;
+            char *newline = memrchr(input, '\n', inputLength);
+            if (upstream >= 0 && newline == NULL && inputLength < inputSize)
+                break; // wait for the rest of the line
+            if (upstream >= 0 && newline != NULL)
+                length = newline - input + 1;
+
+            memcpy(replica->chunk, input, length);
+            replica->pending = replica->chunk;
+            replica->pendingLength = length;
+            memmove(input, input + length, inputLength - length);
+            inputLength -= length;
+            tries = -1;
         }
 
-        pid_t pid1;
-        pid_t pid2;
-        pid_t pid3;
-        pid_t pid4;
-
-        pid1 = fork();
-        if (pid1 < 0)
+        int numberOfFds = 0, live = 0;
+        if (upstream >= 0 && (isOrdered || inputLength < inputSize))
         {
-            printf("Fork failed");
+            fds[numberOfFds] = (struct pollfd){upstream, POLLIN, 0};
+            owner[numberOfFds++] = -1;
         }
-        else if (pid1 == 0) // Child Process 1
+        for (int i = 0; i < numberOfReplicas; i++)
         {
-            dup2(fd[1], STDOUT_FILENO);
-            close(fd[0]);
-            close(fd[1]);
-            close(fd[2]);
-            close(fd[3]);
-            close(fd[4]);
-            close(fd[5]);
-            signal(SIGUSR1, sigusr_Handler);
-            signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-            int execReturn = execvp(arguments[0], arguments);
-            if (execReturn == -1)
+            struct replica *replica = &replicas[i];
+            if (replica->inFd >= 0 && replica->pendingLength == 0 && upstream < 0 && (isOrdered || inputLength == 0))
+            {
+                close(replica->inFd); // nothing left for this replica
+                replica->inFd = -1;
+            }
+            if (replica->inFd >= 0 && replica->pendingLength > 0)
+            {
+                fds[numberOfFds] = (struct pollfd){replica->inFd, POLLOUT, 0};
+                owner[numberOfFds++] = 2 * i;
+            }
+            if (replica->outFd >= 0)
             {
-                perror("execvp"); // Print error if execvp fails
+                fds[numberOfFds] = (struct pollfd){replica->outFd, POLLIN, 0};
+                owner[numberOfFds++] = 2 * i + 1;
+                live++;
             }
         }
-        else
+        if (live == 0)
+            break;
+        if (deadlineFd >= 0)
         {
-            pid2 = fork();
-            if (pid2 < 0)
-            {
-                printf("Fork failed");
-            }
-            else if (pid2 == 0) // Child Process 2
-            {
-                dup2(fd[0], STDIN_FILENO);
-                dup2(fd[3], STDOUT_FILENO);
-                close(fd[0]);
-                close(fd[1]);
-                close(fd[2]);
-                close(fd[3]);
-                close(fd[4]);
-                close(fd[5]);
-                signal(SIGUSR1, sigusr_Handler);
-                signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                int execReturn = execvp(arguments2[0], arguments2);
-                if (execReturn == -1)
-                {
-                    perror("execvp"); // Print error if execvp fails
-                }
+            fds[numberOfFds] = (struct pollfd){deadlineFd, POLLIN, 0};
+            owner[numberOfFds++] = -2;
+        }
+
+        if (poll(fds, numberOfFds, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (int f = 0; f < numberOfFds; f++)
+        {
+            if (fds[f].revents == 0)
+                continue;
+
+            if (owner[f] == -2) // deadline
+            {
+                deadline_expired();
+                continue;
             }
-            else
+            if (owner[f] == -1) // upstream
             {
-                pid3 = fork();
-                if (pid3 < 0)
+                if (isOrdered && inputLength == inputSize)
+                    input = realloc(input, inputSize *= 2);
+                ssize_t n = read(upstream, input + inputLength, inputSize - inputLength);
+                if (n > 0)
+                    inputLength += n;
+                if (n == 0 || (n < 0 && errno != EINTR))
                 {
-                    printf("Fork failed");
+                    close(upstream);
+                    upstream = -1;
                 }
-                else if (pid3 == 0) // Child Process 3
+                if (upstream < 0 && isOrdered) // split into contiguous line-aligned parts
                 {
-                    dup2(fd[2], STDIN_FILENO);
-                    dup2(fd[5], STDOUT_FILENO);
-                    close(fd[0]);
-                    close(fd[1]);
-                    close(fd[2]);
-                    close(fd[3]);
-                    close(fd[4]);
-                    close(fd[5]);
-                    signal(SIGUSR1, sigusr_Handler);
-                    signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                    int execReturn = execvp(arguments3[0], arguments3);
-                    if (execReturn == -1)
+                    size_t start = 0;
+                    for (int i = 0; i < numberOfReplicas; i++)
                     {
-                        perror("execvp"); // Print error if execvp fails
+                        size_t end = inputLength * (i + 1) / numberOfReplicas;
+                        char *newline = end > start ? memchr(input + end - 1, '\n', inputLength - end + 1) : NULL;
+                        end = (newline != NULL && i < numberOfReplicas - 1) ? newline - input + 1 : inputLength;
+                        if (end < start)
+                            end = start;
+                        replicas[i].pending = input + start;
+                        replicas[i].pendingLength = end - start;
+                        start = end;
                     }
                 }
+                continue;
+            }
+
+            struct replica *replica = &replicas[owner[f] / 2];
+            if (owner[f] % 2 == 0) // replica stdin has room
+            {
+                ssize_t n = write(replica->inFd, replica->pending, replica->pendingLength);
+                if (n > 0)
+                {
+                    replica->pending += n;
+                    replica->pendingLength -= n;
+                }
+                else if (n < 0 && errno != EAGAIN && errno != EINTR) // replica exited, its input is lost
+                {
+                    close(replica->inFd);
+                    replica->inFd = -1;
+                    replica->pendingLength = 0;
+                }
+                continue;
+            }
 
+            ssize_t n = read(replica->outFd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n > 0 && isOrdered)
+            {
+                if (replica == &replicas[head])
+                {
+                    if (downstream >= 0 && write_all(downstream, buffer, n) == -1)
+                        downstream = -1;
+                }
                 else
                 {
-                    pid4 = fork();
-                    if (pid4 < 0)
-                    {
-                        printf("Fork failed");
-                    }
-                    else if (pid4 == 0) // Child Process 4
-                    {
-                        dup2(fd[4], STDIN_FILENO);
-                        close(fd[0]);
-                        close(fd[1]);
-                        close(fd[2]);
-                        close(fd[3]);
-                        close(fd[4]);
-                        close(fd[5]);
-                        signal(SIGUSR1, sigusr_Handler);
-                        signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                        int execReturn = execvp(arguments4[0], arguments4);
-                        if (execReturn == -1)
-                        {
-                            perror("execvp"); // Print error if execvp fails
-                        }
-                    }
+                    hold_output(replica, buffer, n);
+                }
+            }
+            else if (n > 0)
+            {
+                hold_output(replica, buffer, n);
+                char *newline = memrchr(replica->output, '\n', replica->outputLength);
+                if (newline != NULL)
+                {
+                    size_t length = newline - replica->output + 1;
+                    if (downstream >= 0 && write_all(downstream, replica->output, length) == -1)
+                        downstream = -1;
+                    memmove(replica->output, replica->output + length, replica->outputLength - length);
+                    replica->outputLength -= length;
+                }
+            }
+            else // replica finished
+            {
+                close(replica->outFd);
+                replica->outFd = -1;
+                replica->isDone = 1;
+                if (!isOrdered && downstream >= 0 && write_all(downstream, replica->output, replica->outputLength) == -1)
+                    downstream = -1;
+                while (isOrdered && head < numberOfReplicas && replicas[head].isDone)
+                {
+                    if (++head < numberOfReplicas && downstream >= 0 &&
+                        write_all(downstream, replicas[head].output, replicas[head].outputLength) == -1)
+                        downstream = -1;
                 }
             }
         }
+    }
+
+    signal(SIGPIPE, SIG_DFL);
+    if (upstream >= 0)
+        close(upstream);
+    for (int i = 0; i < numberOfReplicas; i++)
+    {
+        if (replicas[i].inFd >= 0)
+            close(replicas[i].inFd);
+    }
+    free(input);
+}
+
+// session histograms (stats builtin): every finished command is added to
+// the histograms of its name, in a fixed size table
+enum
+{
+    histogramBuckets = 16 + 37 * 8, // exact below 16, then 8 per power of two up to 2^40
+    maxTracked = 64,                // command names, the rest is counted as "(other)"
+    numberOfMetrics = 5
+};
+
+const char *metricNames[] = {"wall", "user", "sys", "ctx", "maxrss"};
+
+struct histogram
+{
+    unsigned long long sum, max;
+    unsigned int buckets[histogramBuckets];
+};
+
+struct commandHistory
+{
+    char name[32];
+    unsigned long long count;
+    struct histogram metrics[numberOfMetrics]; // wall us, user and sys ticks, context switches, max RSS kB
+};
+
+struct commandHistory history[maxTracked], otherCommands = {"(other)"};
+int numberOfTracked = 0;
+
+int bucket_of(unsigned long long value)
+{
+    if (value < 16)
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > 40)
+        return histogramBuckets - 1;
+    return 16 + (exponent - 4) * 8 + ((value >> (exponent - 3)) & 7);
+}
 
-        close(fd[0]);
-        close(fd[1]);
-        close(fd[2]);
-        close(fd[3]);
-        close(fd[4]);
-        close(fd[5]);
-        signal(SIGUSR1, sigusr_Handler);
-        signal(SIGINT, sigint_Handler);
+// smallest value that falls into bucket
+unsigned long long bucket_start(int bucket)
+{
+    if (bucket < 16)
+        return bucket;
+    int exponent = (bucket - 16) / 8 + 4;
+    return (unsigned long long)(8 + (bucket - 16) % 8) << (exponent - 3);
+}
 
-        int childStatus1, childStatus2, childStatus3, childStatus4;
-        kill(pid1, SIGUSR1);
-        kill(pid2, SIGUSR1);
-        kill(pid3, SIGUSR1);
-        kill(pid4, SIGUSR1);
+// add a finished command to the histograms of its name (without the path)
+void record_command(const char *command, struct processStats *stats)
+{
+    const char *slash = strrchr(command, '/');
+    const char *name = slash != NULL ? slash + 1 : command;
+    unsigned long long values[numberOfMetrics] = {stats->wallTime, stats->user, stats->sys,
+                                                  stats->vctx + stats->nvctx, stats->maxRss};
+    unsigned long long hash = 14695981039346656037ULL;
+    struct commandHistory *entry = &otherCommands;
+
+    for (const char *c = name; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    for (int probe = 0, slot = hash % maxTracked; probe < maxTracked; probe++, slot = (slot + 1) % maxTracked)
+    {
+        if (history[slot].count == 0)
+        {
+            if (numberOfTracked < maxTracked - 1 && strlen(name) < sizeof(history[slot].name))
+            {
+                strcpy(history[slot].name, name);
+                numberOfTracked++;
+                entry = &history[slot];
+            }
+            break;
+        }
+        if (strcmp(history[slot].name, name) == 0)
+        {
+            entry = &history[slot];
+            break;
+        }
+    }
 
-        getProcessStatistics(pid1, commands[0], childStatus1);
-        getProcessStatistics(pid2, commands[1], childStatus2);
-        getProcessStatistics(pid3, commands[2], childStatus3);
-        getProcessStatistics(pid4, commands[3], childStatus4);
+    entry->count++;
+    for (int i = 0; i < numberOfMetrics; i++)
+    {
+        struct histogram *metric = &entry->metrics[i];
+        metric->sum += values[i];
+        if (values[i] > metric->max)
+            metric->max = values[i];
+        metric->buckets[bucket_of(values[i])]++;
     }
+}
 
-    // four pipes
-    if (numberOfCommands == 5 && isSkip == 0)
+// value below which a fraction of the recorded values fall: the end of its
+// bucket (exact below 16), so at most 1/8 too high, and never above the max
+unsigned long long percentile(struct histogram *metric, unsigned long long count, double fraction)
+{
+    unsigned long long rank = fraction * count + 0.999999, seen = 0;
+
+    for (int bucket = 0; bucket < histogramBuckets; bucket++)
     {
-        int fd[8];
-        pipe(fd);
-        pipe(fd + 2);
-        pipe(fd + 4);
-        pipe(fd + 6);
-        if (pipe(fd) == -1 || pipe(fd + 2) == -1 || pipe(fd + 4) == -1 || pipe(fd + 6) == -1)
+        seen += metric->buckets[bucket];
+        if (seen >= rank && seen > 0)
         {
-            printf("Pipe Failed. Try Again");
-            return 0;
+            unsigned long long end = bucket_start(bucket + 1) - 1;
+            return end < metric->max ? end : metric->max;
         }
+    }
+    return metric->max;
+}
+
+int compare_history(const void *a, const void *b)
+{
+    return strcmp((*(struct commandHistory **)a)->name, (*(struct commandHistory **)b)->name);
+}
+
+// commands recorded this session in name order, "(other)" last
+int sorted_history(struct commandHistory *entries[])
+{
+    int count = 0;
 
-        pid_t pid1;
-        pid_t pid2;
-        pid_t pid3;
-        pid_t pid4;
-        pid_t pid5;
+    for (int i = 0; i < maxTracked; i++)
+    {
+        if (history[i].count > 0)
+            entries[count++] = &history[i];
+    }
+    qsort(entries, count, sizeof(entries[0]), compare_history);
+    if (otherCommands.count > 0)
+        entries[count++] = &otherCommands;
+    return count;
+}
 
-        pid1 = fork();
-        if (pid1 < 0)
+// stats: count, mean, p50/p90/p99 and max of every metric of every command
+void print_history()
+{
+    struct commandHistory *entries[maxTracked + 1];
+    const char *labels[] = {"WALL", "USER", "SYS", "CTX", "MAXRSS"};
+    const char *units[] = {"ms", "ms", "ms", "", "kB"};
+    double ticks = sysconf(_SC_CLK_TCK);
+    double scales[] = {1e-3, 1e3 / ticks, 1e3 / ticks, 1, 1}; // to the printed unit
+    int count = sorted_history(entries);
+
+    for (int e = 0; e < count; e++)
+    {
+        struct commandHistory *entry = entries[e];
+        printf("\n(STATS)%s (COUNT)%llu\n", entry->name, entry->count);
+        for (int i = 0; i < numberOfMetrics; i++)
         {
-            printf("Fork failed");
+            struct histogram *metric = &entry->metrics[i];
+            printf("  (%s) (MEAN)%.2f%s (P50)%.2f%s (P90)%.2f%s (P99)%.2f%s (MAX)%.2f%s\n", labels[i],
+                   scales[i] * metric->sum / entry->count, units[i],
+                   scales[i] * percentile(metric, entry->count, 0.50), units[i],
+                   scales[i] * percentile(metric, entry->count, 0.90), units[i],
+                   scales[i] * percentile(metric, entry->count, 0.99), units[i],
+                   scales[i] * metric->max, units[i]);
         }
-        else if (pid1 == 0) // Child Process 1
+    }
+    if (count == 0)
+        printf("no commands have finished yet\n");
+}
+
+// stats json [file]: the histograms themselves, as {start of bucket: count}
+int dump_history(const char *path)
+{
+    struct commandHistory *entries[maxTracked + 1];
+    int count = sorted_history(entries);
+    FILE *out = path != NULL ? fopen(path, "w") : stdout;
+    char escaped[100];
+
+    if (out == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "{\"clockTicks\":%ld,\"units\":{\"wall\":\"us\",\"user\":\"ticks\",\"sys\":\"ticks\",\"ctx\":\"switches\",\"maxrss\":\"kB\"},\"commands\":[",
+            sysconf(_SC_CLK_TCK));
+    for (int e = 0; e < count; e++)
+    {
+        struct commandHistory *entry = entries[e];
+        trace_escape(escaped, sizeof(escaped), entry->name);
+        fprintf(out, "%s\n{\"name\":\"%s\",\"count\":%llu", e > 0 ? "," : "", escaped, entry->count);
+        for (int i = 0; i < numberOfMetrics; i++)
         {
-            dup2(fd[1], STDOUT_FILENO);
-            close(fd[0]);
-            close(fd[1]);
-            close(fd[2]);
-            close(fd[3]);
-            close(fd[4]);
-            close(fd[5]);
-            close(fd[6]);
-            close(fd[7]);
-            signal(SIGUSR1, sigusr_Handler);
-            signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-            int execReturn = execvp(arguments[0], arguments);
-            if (execReturn == -1)
+            struct histogram *metric = &entry->metrics[i];
+            fprintf(out, ",\"%s\":{\"sum\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"buckets\":{",
+                    metricNames[i], metric->sum, metric->max, percentile(metric, entry->count, 0.50),
+                    percentile(metric, entry->count, 0.90), percentile(metric, entry->count, 0.99));
+            for (int bucket = 0, isFirst = 1; bucket < histogramBuckets; bucket++)
             {
-                perror("execvp"); // Print error if execvp fails
+                if (metric->buckets[bucket] == 0)
+                    continue;
+                fprintf(out, "%s\"%llu\":%u", isFirst ? "" : ",", bucket_start(bucket), metric->buckets[bucket]);
+                isFirst = 0;
             }
+            fprintf(out, "}}");
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+    if (path != NULL)
+        fclose(out);
+    return 0;
+}
+
+// exit status of a child as a shell reports it, 128 + signal if it was killed
+int exit_status(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// run a pipeline and print the statistics of each command as it terminates.
+// With consumers the output of the last command is fanned out to every
+// consumer, with parallelStage >= 0 that command runs as several replicas.
+// Returns the exit status of the last command (the first failing replica or
+// consumer when there are several), or jobNotStarted if a pipe or a fork failed
+int run_pipeline(struct pipeline *job)
+{
+    int numberOfCommands = job->numberOfCommands, numberOfConsumers = job->numberOfConsumers;
+    int parallelStage = job->parallelStage, numberOfReplicas = job->numberOfReplicas, isOrdered = job->isOrdered;
+    char ***arguments = job->arguments, ***consumers = job->consumers;
+    int outputFd = job->outputFd >= 0 ? job->outputFd : stageOutput;
+    int fd[2 * maxCommands], fanIn[2], fanOut[2 * maxCommands], relays[2 * maxCommands], outs[maxCommands];
+    int replicaIn[2 * maxReplicas], replicaOut[2 * maxReplicas];
+    int numberOfPipes = numberOfCommands - 1, started = 0;
+    int numberOfChildren = numberOfCommands + numberOfConsumers + (parallelStage >= 0 ? numberOfReplicas - 1 : 0);
+    int childIn[numberOfChildren], childOut[numberOfChildren];
+    char **childArguments[numberOfChildren], *names[numberOfChildren], labels[numberOfChildren][40];
+    struct node *childUnits[numberOfChildren];
+    int pipeEnds[2 * (3 * maxCommands + 2 * maxReplicas)], numberOfPipeEnds = 0;
+    pid_t childPIDs[numberOfChildren];
+    long long forkTimes[numberOfChildren], startTimes[numberOfChildren], childExits[numberOfChildren];
+    struct replica replicas[maxReplicas];
+    struct processStats stats, total = {0};
+    sigset_t usr1Mask, originalMask;
+    int exitCode = 0, lastChild = numberOfChildren - 1;
+    int hasTerminal = 0;
+    int relaySize = 0; // bytes every fan-out relay can take at once
+
+    if (numberOfConsumers > 0)
+        lastChild = numberOfChildren - numberOfConsumers;
+    else if (parallelStage == numberOfCommands - 1)
+        lastChild = parallelStage;
+
+    // every pipe end is close-on-exec, a child only keeps what it dup2()s
+    if (open_pipes(fd, numberOfPipes) == -1)
+        return jobNotStarted;
+    if (numberOfConsumers > 0)
+    {
+        if (open_pipes(fanIn, 1) == -1 || open_pipes(fanOut, numberOfConsumers) == -1 ||
+            open_pipes(relays, numberOfConsumers - 1) == -1)
+        {
+            printf("\n");
+            return jobNotStarted;
+        }
+
+        // bigger pipes mean fewer rounds of tee(), but a resize can fail at the
+        // per-user pipe limit, so tee() is kept to what the smallest relay holds
+        fcntl(fanIn[0], F_SETPIPE_SZ, 1 << 20);
+        int pipeSize = fcntl(fanIn[0], F_GETPIPE_SZ);
+        for (int i = 0; i < numberOfConsumers; i++)
+            fcntl(fanOut[2 * i], F_SETPIPE_SZ, pipeSize);
+        relaySize = pipeSize;
+        for (int i = 0; i < numberOfConsumers - 1; i++)
+        {
+            fcntl(relays[2 * i], F_SETPIPE_SZ, pipeSize);
+            int size = fcntl(relays[2 * i], F_GETPIPE_SZ);
+            if (size < relaySize)
+                relaySize = size;
+        }
+        if (relaySize <= 0)
+        {
+            perror("F_GETPIPE_SZ");
+            relaySize = 4096; // pipes always hold at least a page
+        }
+    }
+    if (parallelStage >= 0 && (open_pipes(replicaIn, numberOfReplicas) == -1 || open_pipes(replicaOut, numberOfReplicas) == -1))
+    {
+        printf("\n");
+        return jobNotStarted;
+    }
+
+    // who runs what: every command, the replicas of the parallel stage, then the consumers
+    for (int i = 0, k = 0; i < numberOfCommands; i++)
+    {
+        for (int r = 0; r < (i == parallelStage ? numberOfReplicas : 1); r++, k++)
+        {
+            childArguments[k] = arguments[i];
+            childUnits[k] = job->units[i];
+            names[k] = arguments[i][0];
+            if (i == parallelStage)
+            {
+                childIn[k] = replicaIn[2 * r];
+                childOut[k] = replicaOut[2 * r + 1];
+                snprintf(labels[k], sizeof(labels[k]), "stage %d replica %d", i + 1, r + 1);
+                continue;
+            }
+            childIn[k] = (job->inputFds[i] >= 0) ? job->inputFds[i] : (i == 0) ? stageInput : fd[2 * (i - 1)];
+            childOut[k] = (i < numberOfCommands - 1) ? fd[2 * i + 1] : (numberOfConsumers > 0 ? fanIn[1] : outputFd);
+            snprintf(labels[k], sizeof(labels[k]), "stage %d", i + 1);
+        }
+    }
+    for (int c = 0; c < numberOfConsumers; c++)
+    {
+        int k = numberOfChildren - numberOfConsumers + c;
+        childArguments[k] = consumers[c];
+        childUnits[k] = NULL;
+        names[k] = consumers[c][0];
+        childIn[k] = fanOut[2 * c];
+        childOut[k] = outputFd;
+        snprintf(labels[k], sizeof(labels[k]), "consumer %d", c + 1);
+    }
+
+    // everything opened above, for ( ) and { } stages to close
+    for (int i = 0; i < 2 * numberOfPipes; i++)
+        pipeEnds[numberOfPipeEnds++] = fd[i];
+    for (int i = 0; numberOfConsumers > 0 && i < 2; i++)
+        pipeEnds[numberOfPipeEnds++] = fanIn[i];
+    for (int i = 0; i < 2 * numberOfConsumers; i++)
+        pipeEnds[numberOfPipeEnds++] = fanOut[i];
+    for (int i = 0; i < 2 * (numberOfConsumers - 1); i++)
+        pipeEnds[numberOfPipeEnds++] = relays[i];
+    for (int i = 0; parallelStage >= 0 && i < 2 * numberOfReplicas; i++)
+    {
+        pipeEnds[numberOfPipeEnds++] = replicaIn[i];
+        pipeEnds[numberOfPipeEnds++] = replicaOut[i];
+    }
+    jobPipes = pipeEnds;
+    numberOfJobPipes = numberOfPipeEnds;
+
+    // SIGUSR1 stays blocked until every child is waiting for it
+    sigemptyset(&usr1Mask);
+    sigaddset(&usr1Mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &usr1Mask, &originalMask);
+    fflush(stdout);
+
+    // a job with a deadline runs in a process group of its own, so it can be
+    // killed as a whole, and the shell waits for its children with the timer in view
+    if (job->timeout > 0)
+    {
+        deadlineFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (deadlineFd < 0)
+            perror("timerfd_create");
+    }
+
+    memset(childExits, 0, sizeof(childExits));
+    watchedPids = childPIDs;
+    exitTimes = childExits;
+    for (int i = 0; i < numberOfChildren; i++)
+    {
+        forkTimes[i] = trace_now();
+        startTimes[i] = monotonic_us();
+        childPIDs[i] = start_stage(childArguments[i], childUnits[i], childIn[i], childOut[i], &originalMask,
+                                   deadlineFd < 0 ? -1 : (i == 0 ? 0 : childPIDs[0]));
+        if (childPIDs[i] < 0)
+        {
+            printf("Fork failed");
+            break;
+        }
+        trace_event("fork", 'X', currPid, forkTimes[i], trace_now() - forkTimes[i], NULL);
+        trace_stage_name(childPIDs[i], labels[i], childArguments[i]);
+        started++;
+        numberOfWatched = started;
+    }
+
+    numberOfJobPipes = 0;
+
+    // the shell keeps only the pipe ends it pumps itself
+    for (int i = 0; i < numberOfPipes; i++)
+    {
+        if (i != parallelStage - 1)
+            close(fd[2 * i]);
+        if (i != parallelStage)
+            close(fd[2 * i + 1]);
+    }
+    if (numberOfConsumers > 0)
+    {
+        close(fanIn[1]);
+        for (int i = 0; i < numberOfConsumers; i++)
+        {
+            close(fanOut[2 * i]);
+            outs[i] = fanOut[2 * i + 1];
+        }
+    }
+    for (int r = 0; parallelStage >= 0 && r < numberOfReplicas; r++)
+    {
+        close(replicaIn[2 * r]);
+        close(replicaOut[2 * r + 1]);
+        fcntl(replicaIn[2 * r + 1], F_SETFL, O_NONBLOCK);
+        replicas[r] = (struct replica){replicaIn[2 * r + 1], replicaOut[2 * r]};
+        replicas[r].chunk = malloc(2 * parChunk);
+    }
+
+    if (deadlineFd >= 0 && started > 0)
+    {
+        jobGroup = childPIDs[0];
+        jobTimeout = job->timeout;
+        deadlineStage = 0;
+        // the terminal goes with the job, so Ctrl-C and reads from it reach the job's group
+        if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp())
+            hasTerminal = tcsetpgrp(STDIN_FILENO, jobGroup) == 0;
+        arm_deadline(job->timeout);
+    }
+
+    for (int i = 0; i < started; i++)
+        kill(childPIDs[i], SIGUSR1);
+    sigprocmask(SIG_SETMASK, &originalMask, NULL);
+
+    if (numberOfConsumers > 0)
+    {
+        if (started == numberOfChildren)
+            fanout_pump(fanIn[0], outs, relays, relaySize, numberOfConsumers, childPIDs[numberOfChildren - numberOfConsumers - 1],
+                        childPIDs + numberOfChildren - numberOfConsumers);
+        close(fanIn[0]);
+        for (int i = 0; i < numberOfConsumers; i++)
+        {
+            if (outs[i] >= 0)
+                close(outs[i]);
+        }
+        for (int i = 0; i < 2 * (numberOfConsumers - 1); i++)
+            close(relays[i]);
+    }
+    if (parallelStage >= 0)
+    {
+        int downstream = (parallelStage < numberOfPipes) ? fd[2 * parallelStage + 1] : (outputFd >= 0 ? outputFd : STDOUT_FILENO);
+        if (started == numberOfChildren)
+        {
+            parallel_pump(fd[2 * (parallelStage - 1)], downstream, replicas, numberOfReplicas, isOrdered);
         }
         else
         {
-            pid2 = fork();
-            if (pid2 < 0)
-            {
-                printf("Fork failed");
-            }
-            else if (pid2 == 0) // Child Process 2
-            {
-                dup2(fd[0], STDIN_FILENO);
-                dup2(fd[3], STDOUT_FILENO);
-                close(fd[0]);
-                close(fd[1]);
-                close(fd[2]);
-                close(fd[3]);
-                close(fd[4]);
-                close(fd[5]);
-                close(fd[6]);
-                close(fd[7]);
-                signal(SIGUSR1, sigusr_Handler);
-                signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                int execReturn = execvp(arguments2[0], arguments2);
-                if (execReturn == -1)
+            close(fd[2 * (parallelStage - 1)]);
+            for (int r = 0; r < numberOfReplicas; r++)
+                close(replicas[r].inFd);
+        }
+        if (parallelStage < numberOfPipes)
+            close(downstream);
+        for (int r = 0; r < numberOfReplicas; r++)
+        {
+            if (replicas[r].outFd >= 0)
+                close(replicas[r].outFd);
+            free(replicas[r].chunk);
+            free(replicas[r].output);
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        if (deadlineFd >= 0)
+            wait_for_child();
+        int child = getProcessStatistics(childPIDs, names, forkTimes, childExits, started, &stats);
+        if (child >= 0)
+        {
+            stats.wallTime = childExits[child] - startTimes[child];
+            record_command(names[child], &stats);
+        }
+        if (child >= lastChild && exitCode == 0)
+            exitCode = exit_status(stats.status);
+        if (WIFEXITED(stats.status) && (WEXITSTATUS(stats.status) == 126 || WEXITSTATUS(stats.status) == 127))
+            job->hasExecFailed = 1;
+        if (parallelStage >= 0 && child >= parallelStage && child < parallelStage + numberOfReplicas)
+        {
+            total.user += stats.user;
+            total.sys += stats.sys;
+            total.vctx += stats.vctx;
+            total.nvctx += stats.nvctx;
+        }
+    }
+    numberOfWatched = 0;
+    if (parallelStage >= 0)
+    {
+        printf("\n(PAR)%s (REPLICAS)%d (USER)%.2ld (SYS)%.2ld (VCTX)%d (NVCTX)%d\n",
+               arguments[parallelStage][0], numberOfReplicas, total.user, total.sys, total.vctx, total.nvctx);
+    }
+
+    job->isTimedOut = deadlineStage > 0;
+    if (deadlineFd >= 0)
+    {
+        if (hasTerminal) // from a background group this needs SIGTTOU blocked
+        {
+            sigset_t ttouMask;
+            sigemptyset(&ttouMask);
+            sigaddset(&ttouMask, SIGTTOU);
+            sigprocmask(SIG_BLOCK, &ttouMask, NULL);
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+            sigprocmask(SIG_UNBLOCK, &ttouMask, NULL);
+        }
+        close(deadlineFd);
+        deadlineFd = -1;
+        deadlineStage = 0;
+        jobGroup = 0;
+    }
+    if (started < numberOfChildren)
+        return jobNotStarted;
+    if (job->isTimedOut) // as timeout(1) reports it
+        return 124;
+    return exitCode;
+}
+
+// FNV-1a over length bytes of data, continuing from hash
+unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
+}
+
+unsigned long long hash_string(unsigned long long hash, const char *text)
+{
+    return hash_bytes(hash, text, strlen(text) + 1);
+}
+
+unsigned long long hash_variable(unsigned long long hash, const char *name)
+{
+    char *value = getenv(name);
+
+    hash = hash_string(hash, name);
+    return hash_string(hash, value != NULL ? value : "");
+}
+
+// key of a cached pipeline: its words, the working directory, the locale and
+// PATH (plus the variables listed in JCSHELL_CACHE_ENV) and the identity of
+// every argument that names a regular file, so editing an input is a miss
+unsigned long long cache_key(struct pipeline *job)
+{
+    const char *environment[] = {"PATH", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "TZ"};
+    unsigned long long hash = 14695981039346656037ULL;
+    char cwd[4096], names[maxChar];
+    char *extra = getenv("JCSHELL_CACHE_ENV");
+    int layout[] = {job->numberOfCommands, job->numberOfConsumers, job->parallelStage, job->numberOfReplicas, job->isOrdered};
+    struct stat file;
+
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        hash = hash_string(hash, cwd);
+    for (int i = 0; i < (int)(sizeof(environment) / sizeof(environment[0])); i++)
+        hash = hash_variable(hash, environment[i]);
+    if (extra != NULL)
+    {
+        snprintf(names, sizeof(names), "%s", extra);
+        for (char *name = strtok(names, ":"); name != NULL; name = strtok(NULL, ":"))
+            hash = hash_variable(hash, name);
+    }
+
+    hash = hash_bytes(hash, layout, sizeof(layout));
+    for (int i = 0; i < job->numberOfCommands + job->numberOfConsumers; i++)
+    {
+        char **arguments = i < job->numberOfCommands ? job->arguments[i] : job->consumers[i - job->numberOfCommands];
+        for (int j = 0; arguments[j] != NULL; j++)
+        {
+            hash = hash_string(hash, arguments[j]);
+            if (j > 0 && stat(arguments[j], &file) == 0 && S_ISREG(file.st_mode))
+            {
+                long long identity[] = {file.st_dev, file.st_ino, file.st_size, file.st_mtim.tv_sec, file.st_mtim.tv_nsec};
+                hash = hash_bytes(hash, identity, sizeof(identity));
+            }
+        }
+        if (i < job->numberOfCommands && job->inputFds[i] >= 0 && fstat(job->inputFds[i], &file) == 0)
+        {
+            char *contents = mmap(NULL, file.st_size, PROT_READ, MAP_PRIVATE, job->inputFds[i], 0);
+            if (file.st_size > 0 && contents != MAP_FAILED)
+            {
+                hash = hash_bytes(hash, contents, file.st_size);
+                munmap(contents, file.st_size);
+            }
+        }
+        hash = hash_string(hash, "|");
+    }
+    return hash;
+}
+
+// $XDG_CACHE_HOME/jcshell or ~/.cache/jcshell, created if needed
+int cache_directory(char *directory, int size)
+{
+    char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+    if (base != NULL && strcmp(base, "") != 0)
+        snprintf(directory, size, "%s", base);
+    else if (home != NULL)
+        snprintf(directory, size, "%s/.cache", home);
+    else
+        return -1;
+    mkdir(directory, 0755);
+    strncat(directory, "/jcshell", size - strlen(directory) - 1);
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+struct cacheEntry
+{
+    char name[20];
+    long long size;
+    struct timespec used; // mtime, touched on every hit
+};
+
+int compare_entries(const void *a, const void *b)
+{
+    const struct cacheEntry *x = a, *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// drop the least recently used entries until the cache fits in cacheMax
+void cache_evict(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    struct cacheEntry *entries = NULL;
+    struct stat file;
+    char path[4200];
+    int count = 0, capacity = 0;
+    long long total = 0;
+
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        // finished entries are named by their 16 hex digit key
+        if (strlen(entry->d_name) != 16 || strspn(entry->d_name, "0123456789abcdef") != 16 ||
+            fstatat(dirfd(dir), entry->d_name, &file, 0) == -1)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            entries = realloc(entries, capacity * sizeof(*entries));
+        }
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", entry->d_name);
+        entries[count].size = file.st_size;
+        entries[count].used = file.st_mtim;
+        total += file.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > cacheMax)
+    {
+        qsort(entries, count, sizeof(*entries), compare_entries);
+        for (int i = 0; i < count && total > cacheMax; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", directory, entries[i].name);
+            if (unlink(path) == 0)
+                total -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+
+// an entry starts with a fixed size header holding the exit status of the
+// run, followed by its output
+const char *cacheHeader = "JCSHELL-CACHE %3d\n";
+int cacheHeaderLength = 18;
+
+// copy everything the pipeline writes into in to stdout and into file. Keeps
+// reading until the pipeline is done even if stdout goes away or the entry
+// gets too big, so the recorder never exits before the job it records.
+// Returns 0 if file holds the whole output
+int cache_record(int in, int file)
+{
+    int out = stageOutput >= 0 ? stageOutput : STDOUT_FILENO;
+    char *buffer = malloc(parChunk);
+    long long stored = 0;
+    int isStdoutOpen = 1, isComplete = 1;
+    ssize_t n;
+
+    signal(SIGPIPE, SIG_IGN);
+    while ((n = read(in, buffer, parChunk)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            isComplete = 0;
+            break;
+        }
+        if (isStdoutOpen && write_all(out, buffer, n) == -1)
+            isStdoutOpen = 0;
+        stored += n;
+        if (isComplete && (stored > cacheMax || write_all(file, buffer, n) == -1))
+            isComplete = 0;
+    }
+    free(buffer);
+    return isComplete ? 0 : 1;
+}
+
+// write the output stored in an entry to stdout, with sendfile() when it can
+void cache_replay(int fd)
+{
+    int out = stageOutput >= 0 ? stageOutput : STDOUT_FILENO;
+    struct stat entry;
+    off_t offset = cacheHeaderLength;
+    char buffer[4096];
+    ssize_t n;
+
+    fflush(stdout);
+    if (fstat(fd, &entry) == -1)
+        return;
+    while (offset < entry.st_size)
+    {
+        n = sendfile(out, fd, &offset, entry.st_size - offset);
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        break;
+    }
+    // stdout that sendfile() cannot write to, e.g. opened with O_APPEND
+    while (offset < entry.st_size && (n = pread(fd, buffer, sizeof(buffer), offset)) > 0)
+    {
+        if (write_all(out, buffer, n) == -1)
+            break;
+        offset += n;
+    }
+}
+
+// cache cmd1 | cmd2 ...: if the same pipeline already ran on the same inputs
+// replay its output and exit status without starting anything, otherwise run
+// it and record its output on the way to stdout. Runs that did not start,
+// could not run a command (126, 127), were killed by a signal or went past
+// their deadline are not stored, they may well succeed the next time
+int run_cached(struct pipeline *job)
+{
+    char directory[4096], path[4200], temporary[4300], header[32];
+    int fd, file, exitCode, status, capture[2];
+    unsigned long long key;
+    pid_t recorder;
+
+    for (int i = 0; i < job->numberOfCommands; i++)
+    {
+        if (job->units[i] != NULL) // the key only covers the words of the commands
+        {
+            printf("cache: pipelines with ( ) or { } stages are not cached, running uncached\n");
+            return run_pipeline(job);
+        }
+    }
+    if (cache_directory(directory, sizeof(directory)) == -1)
+    {
+        printf("cache: no cache directory, running uncached\n");
+        return run_pipeline(job);
+    }
+    key = cache_key(job);
+    snprintf(path, sizeof(path), "%s/%016llx", directory, key);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && read(fd, header, cacheHeaderLength) == cacheHeaderLength &&
+        sscanf(header, "JCSHELL-CACHE %d", &exitCode) == 1)
+    {
+        cacheHits++;
+        cache_replay(fd);
+        close(fd);
+        utimensat(AT_FDCWD, path, NULL, 0); // now the most recently used entry
+        printf("\n(CACHE)HIT (KEY)%016llx (EXCODE)%d (HITS)%d (MISSES)%d\n", key, exitCode, cacheHits, cacheMisses);
+        return exitCode;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    cacheMisses++;
+    snprintf(temporary, sizeof(temporary), "%s.tmp.%d", path, getpid());
+    file = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0 || pipe2(capture, O_CLOEXEC) == -1)
+    {
+        printf("cache: cannot record into %s, running uncached\n", directory);
+        if (file >= 0)
+        {
+            close(file);
+            unlink(temporary);
+        }
+        return run_pipeline(job);
+    }
+    snprintf(header, sizeof(header), cacheHeader, 0);
+    write_all(file, header, cacheHeaderLength);
+
+    fflush(stdout);
+    recorder = fork();
+    if (recorder == 0)
+    {
+        signal(SIGINT, SIG_IGN); // stops when the job does
+        close(capture[1]);
+        _exit(cache_record(capture[0], file));
+    }
+    close(capture[0]);
+    if (recorder < 0)
+    {
+        printf("Fork failed");
+        close(capture[1]);
+        close(file);
+        unlink(temporary);
+        return 1;
+    }
+
+    // the shell holds the write end until every stage has been waited for,
+    // so the recorder is never collected as one of the job's children
+    job->outputFd = capture[1];
+    job->hasExecFailed = 0;
+    exitCode = run_pipeline(job);
+    job->outputFd = -1;
+    close(capture[1]);
+    waitpid(recorder, &status, 0);
+
+    int isStorable = exitCode != jobNotStarted && !job->hasExecFailed && exitCode < 128 && !job->isTimedOut;
+    if (exitCode == jobNotStarted)
+        exitCode = 1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && isStorable)
+    {
+        snprintf(header, sizeof(header), cacheHeader, exitCode);
+        pwrite(file, header, cacheHeaderLength, 0);
+        close(file);
+        rename(temporary, path);
+        cache_evict(directory);
+    }
+    else
+    {
+        close(file);
+        unlink(temporary);
+    }
+    printf("\n(CACHE)MISS (KEY)%016llx (EXCODE)%d (HITS)%d (MISSES)%d\n", key, exitCode, cacheHits, cacheMisses);
+    return exitCode;
+}
+
+// number of jobs in a command line, a subshell counts as one job
+int count_jobs(struct node *node)
+{
+    if (node->type == NODE_PIPELINE || node->type == NODE_SUBSHELL)
+        return 1;
+    return count_jobs(node->left) + (node->right != NULL ? count_jobs(node->right) : 0);
+}
+
+// run a parsed command line and return the exit status of what ran last.
+// && and || run their right side only if the left side succeeded/failed
+int run_node(struct node *node, int *ran)
+{
+    int status;
+    pid_t pid;
+
+    switch (node->type)
+    {
+    case NODE_PIPELINE:
+        (*ran)++;
+        // exit handling
+        if (strcmp(node->pipeline->arguments[0][0], "exit") == 0)
+        {
+            if (node->pipeline->numberOfCommands > 1 || node->pipeline->numberOfConsumers > 0 || node->pipeline->arguments[0][1] != NULL)
+            {
+                printf("exit with extra arguments!!!\n");
+                return 1;
+            }
+            fflush(stdout);
+            if (isSubshell) // exit() would rewind the stdin the parent shell reads from
+                _exit(0);
+            kill(0, SIGTERM);
+            exit(0);
+        }
+        if (strcmp(node->pipeline->arguments[0][0], "stats") == 0)
+        {
+            char **arguments = node->pipeline->arguments[0];
+            if (node->pipeline->numberOfCommands > 1 || node->pipeline->numberOfConsumers > 0 ||
+                (arguments[1] != NULL && (strcmp(arguments[1], "json") != 0 || (arguments[2] != NULL && arguments[3] != NULL))))
+            {
+                printf("usage: stats [json [file]]\n");
+                return 1;
+            }
+            if (arguments[1] != NULL)
+                return dump_history(arguments[2]);
+            print_history();
+            return 0;
+        }
+        // cache and timeout <duration> [--] prefix the first command, in any order
+        char **arguments = node->pipeline->arguments[0];
+        int isCached = 0;
+        while (strcmp(arguments[0], "cache") == 0 || strcmp(arguments[0], "timeout") == 0)
+        {
+            int prefixLength = 1;
+            if (strcmp(arguments[0], "timeout") == 0)
+            {
+                double timeout = arguments[1] != NULL ? parse_duration(arguments[1]) : -1;
+                if (timeout < 0)
                 {
-                    perror("execvp"); // Print error if execvp fails
+                    printf("timeout needs a duration like 30, 30s, 500ms, 2m or 1h\n");
+                    return 1;
                 }
+                node->pipeline->timeout = timeout;
+                prefixLength = (arguments[2] != NULL && strcmp(arguments[2], "--") == 0) ? 3 : 2;
             }
             else
             {
-                pid3 = fork();
-                if (pid3 < 0)
-                {
-                    printf("Fork failed");
-                }
-                else if (pid3 == 0) // Child Process 3
-                {
-                    dup2(fd[2], STDIN_FILENO);
-                    dup2(fd[5], STDOUT_FILENO);
-                    close(fd[0]);
-                    close(fd[1]);
-                    close(fd[2]);
-                    close(fd[3]);
-                    close(fd[4]);
-                    close(fd[5]);
-                    close(fd[6]);
-                    close(fd[7]);
-                    signal(SIGUSR1, sigusr_Handler);
-                    signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                    int execReturn = execvp(arguments3[0], arguments3);
-                    if (execReturn == -1)
-                    {
-                        perror("execvp"); // Print error if execvp fails
-                    }
-                }
-
-                else
-                {
-                    pid4 = fork();
-                    if (pid4 < 0)
-                    {
-                        printf("Fork failed");
-                    }
-                    else if (pid4 == 0) // Child Process 4
-                    {
-                        dup2(fd[4], STDIN_FILENO);
-                        dup2(fd[7], STDOUT_FILENO);
-                        close(fd[0]);
-                        close(fd[1]);
-                        close(fd[2]);
-                        close(fd[3]);
-                        close(fd[4]);
-                        close(fd[5]);
-                        close(fd[6]);
-                        close(fd[7]);
-                        signal(SIGUSR1, sigusr_Handler);
-                        signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                        int execReturn = execvp(arguments4[0], arguments4);
-                        if (execReturn == -1)
-                        {
-                            perror("execvp"); // Print error if execvp fails
-                        }
-                    }
-                    else
-                    {
+                isCached = 1;
+            }
 
-                        pid5 = fork();
-                        if (pid5 < 0)
-                        {
-                            printf("Fork failed");
-                        }
-                        else if (pid5 == 0) // Child Process 5
-                        {
-                            dup2(fd[6], STDIN_FILENO);
-                            close(fd[0]);
-                            close(fd[1]);
-                            close(fd[2]);
-                            close(fd[3]);
-                            close(fd[4]);
-                            close(fd[5]);
-                            close(fd[6]);
-                            close(fd[7]);
-                            signal(SIGUSR1, sigusr_Handler);
-                            signal(SIGINT, SIG_DFL); // child command handles with default behaviour
-                            int execReturn = execvp(arguments5[0], arguments5);
-                            if (execReturn == -1)
-                            {
-                                perror("execvp"); // Print error if execvp fails
-                            }
-                        }
-                    }
-                }
+            for (int i = 0; i < prefixLength; i++)
+                free(arguments[i]);
+            memmove(arguments, arguments + prefixLength, (maxString - prefixLength) * sizeof(char *));
+            if (arguments[0] == NULL)
+            {
+                printf("cache and timeout need a command\n");
+                return 1;
             }
         }
+        status = isCached ? run_cached(node->pipeline) : run_pipeline(node->pipeline);
+        return status == jobNotStarted ? 1 : status;
+
+    case NODE_SEQUENCE:
+        run_node(node->left, ran);
+        return run_node(node->right, ran);
+
+    case NODE_AND:
+        status = run_node(node->left, ran);
+        return status == 0 ? run_node(node->right, ran) : status;
+
+    case NODE_OR:
+        status = run_node(node->left, ran);
+        return status != 0 ? run_node(node->right, ran) : status;
+
+    case NODE_GROUP:
+        return run_node(node->left, ran);
+
+    default: // NODE_SUBSHELL
+        (*ran)++;
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0)
+        {
+            printf("Fork failed");
+            return 1;
+        }
+        if (pid == 0) // the subshell prints the statistics of its own children
+        {
+            isSubshell = 1;
+            status = run_node(node->left, ran);
+            fflush(stdout);
+            _exit(status); // exit() would rewind the stdin the parent shell reads from
+        }
+        waitpid(pid, &status, 0);
+        return exit_status(status);
+    }
+}
 
-        close(fd[0]);
-        close(fd[1]);
-        close(fd[2]);
-        close(fd[3]);
-        close(fd[4]);
-        close(fd[5]);
-        close(fd[6]);
-        close(fd[7]);
-        signal(SIGUSR1, sigusr_Handler);
-        signal(SIGINT, sigint_Handler);
+// run a command line, a list of more than one job ends with a summary line
+void run_list(struct node *commandLine)
+{
+    struct timespec start, end;
+    int ran = 0, numberOfJobs = count_jobs(commandLine);
 
-        int childStatus1, childStatus2, childStatus3, childStatus4, childStatus5;
-        kill(pid1, SIGUSR1);
-        kill(pid2, SIGUSR1);
-        kill(pid3, SIGUSR1);
-        kill(pid4, SIGUSR1);
-        kill(pid5, SIGUSR1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_node(commandLine, &ran);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-        getProcessStatistics(pid1, commands[0], childStatus1);
-        getProcessStatistics(pid2, commands[1], childStatus2);
-        getProcessStatistics(pid3, commands[2], childStatus3);
-        getProcessStatistics(pid4, commands[3], childStatus4);
-        getProcessStatistics(pid5, commands[4], childStatus5);
+    if (numberOfJobs > 1)
+    {
+        printf("\n(LIST) (JOBS)%d (RAN)%d (EXCODE)%d (REAL)%.2f\n", numberOfJobs, ran, status,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
     }
+}
+
+int start_process()
+{
+    signal(SIGINT, sigint_Handler);
+    signal(SIGUSR1, sigusr_Handler);
+    signal(SIGCHLD, sigchld_Handler);
+
+    char *line = NULL;
+    size_t lineSize = 0;
 
-    // if more than 4 pipes (i.e more than 5 commands)
-    if (numberOfCommands > 5 && isSkip == 0)
+    // get user input
+    currPid = getpid();
+    trace_event("prompt", 'i', currPid, trace_now(), 0, NULL);
+    printf("## JCshell [%d] ## ", getpid()); // print shell prompt
+    long long readStart = trace_now();
+    if (getline(&line, &lineSize, stdin) == -1) // end of input (Ctrl-D)
     {
-        printf("JCshell cannot accept more than 5 commands!\n");
+        printf("\n");
+        exit(0);
     }
+    trace_event("read input", 'X', currPid, readStart, trace_now() - readStart, NULL);
+
+    long long parseStart = trace_now();
+    struct node *commandLine = parse_commands(line); // parse user input to get commands
+    trace_event("parse_commands", 'X', currPid, parseStart, trace_now() - parseStart, NULL);
+    free(line);
+    if (commandLine == NULL) // empty line or syntax error
+        return 0;
+
+    run_list(commandLine);
+    free_node(commandLine);
+    return 0;
 }
 
 int main()
 {
+    currPid = getpid();
+    trace_open();
+    char *metrics = getenv("JCSHELL_XMETRICS");
+    isExtendedMetrics = metrics != NULL && strcmp(metrics, "") != 0 && strcmp(metrics, "0") != 0;
+    char *timeout = getenv("JCSHELL_TIMEOUT");
+    if (timeout != NULL && strcmp(timeout, "") != 0 && (defaultTimeout = parse_duration(timeout)) < 0)
+    {
+        printf("JCSHELL_TIMEOUT is not a duration like 30, 30s, 500ms, 2m or 1h\n");
+        defaultTimeout = 0;
+    }
+    char *cacheLimit = getenv("JCSHELL_CACHE_MAX");
+    if (cacheLimit != NULL && atoll(cacheLimit) > 0)
+        cacheMax = atoll(cacheLimit);
     while (1)
     {
         start_process();
-        isSkip = 0;
     }
 }
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Wall time of a CPU-bound pipeline stage run as one replica and as N
+# replicas (@par=N) of JCshell.
+#
+#     sh bench/par_bench.sh [replicas] [lines] [rounds]
+#
+# Builds the shell, writes an input of `lines` text lines and times
+#     cat input | gzip -9 @par=R,ordered | gunzip | cksum
+# for R = 1 and R = replicas (default: the number of CPUs). The checksum must
+# match the input's for both runs, so the ordered merge is checked as well.
+# Prints the best of `rounds` runs of each and the speedup. The speedup can
+# only go above 1 on a machine with more than one CPU.
+
+replicas=${1:-$(nproc)}
+lines=${2:-2000000}
+rounds=${3:-3}
+here=$(dirname "$0")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -std=gnu11 -O2 -o "$work/JCshell" "$here/../JCshell.c" || exit 1
+seq -f "line %g of the JCshell @par benchmark" 1 "$lines" > "$work/input"
+expected=$(cksum < "$work/input")
+
+# best wall time in ms of `rounds` runs with $1 replicas, fails on a wrong checksum
+run()
+{
+    best=
+    for round in $(seq 1 "$rounds"); do
+        start=$(date +%s%N)
+        output=$(printf 'cat %s | gzip -9 @par=%d,ordered | gunzip | cksum\n' "$work/input" "$1" | "$work/JCshell")
+        end=$(date +%s%N)
+        if ! printf '%s\n' "$output" | grep -q "$expected"; then
+            echo "@par=$1: output does not match the input" >&2
+            exit 1
+        fi
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+single=$(run 1) || exit 1
+parallel=$(run "$replicas") || exit 1
+echo "cpus $(nproc), input $(wc -c < "$work/input") bytes, best of $rounds"
+echo "@par=1            $single ms"
+echo "@par=$replicas            $parallel ms"
+awk -v a="$single" -v b="$parallel" 'BEGIN { printf "speedup           %.2fx\n", a / b }'
@@ -0,0 +1,136 @@
+/**
+ * Micro-benchmark of the /proc statistics parser of JCshell and check of
+ * the cost of the extended metrics (JCSHELL_XMETRICS=1).
+ *
+ *     gcc -O2 -o proc_stats_bench bench/proc_stats_bench.c && ./proc_stats_bench
+ *
+ * Prints the time per call of parse_stat() and parse_fields() and the time
+ * per process of the base (stat, status) and extra (io, schedstat) reads on
+ * zombie children, as the shell does them. Exits with 1 if the extra reads
+ * cost more than 20 us per process or the parser gets a field wrong.
+ */
+
+#define main jcshell_main
+#include "../JCshell.c"
+#undef main
+
+int numberOfZombies = 64;
+int rounds = 20;
+double extraBudget = 20000; // ns per process
+
+double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// check the parser on a comm with blanks and ')' and time it
+int bench_parse_stat()
+{
+    char sample[] = "4242 (my (odd) cmd) S 4200 4242 4242 0 -1 4194560 120 0 0 0 17 5 0 0 20 0 1 0 123 4096 100 18446744073709551615";
+    struct processStats stats;
+    struct timespec start, end;
+    int iterations = 1000000;
+
+    memset(&stats, 0, sizeof(stats));
+    if (parse_stat(sample, strlen(sample), &stats) == -1 || stats.pid != 4242 || stats.state != 'S' ||
+        stats.ppid != 4200 || stats.user != 17 || stats.sys != 5)
+    {
+        printf("parse_stat: wrong fields (pid %d state %c ppid %d user %lu sys %lu)\n",
+               stats.pid, stats.state, stats.ppid, stats.user, stats.sys);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++)
+        parse_stat(sample, sizeof(sample) - 1, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("parse_stat             %8.1f ns\n", elapsed_ns(&start, &end) / iterations);
+    return 0;
+}
+
+// time one pass over /proc/self/status for the two context switch fields
+int bench_parse_fields()
+{
+    const char *names[] = {"voluntary_ctxt_switches", "nonvoluntary_ctxt_switches"};
+    unsigned long long values[2] = {~0ULL, ~0ULL}; // left alone when a field is missing
+    char buffer[4096];
+    struct timespec start, end;
+    int iterations = 200000, length = read_proc_file(getpid(), "status", buffer, sizeof(buffer));
+
+    if (length < 0)
+    {
+        printf("cannot read /proc/self/status\n");
+        return -1;
+    }
+    parse_fields(buffer, names, values, 2);
+    if (values[0] == ~0ULL || values[1] == ~0ULL)
+    {
+        printf("parse_fields: context switch fields not found\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++)
+        parse_fields(buffer, names, values, 2);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("parse_fields (status)  %8.1f ns\n", elapsed_ns(&start, &end) / iterations);
+    return 0;
+}
+
+// the reads getProcessStatistics() does for one zombie, base or extra set
+void read_zombie(pid_t pid, int isExtra)
+{
+    struct processStats stats;
+
+    if (isExtra)
+        read_extended_metrics(pid, &stats);
+    else
+        read_base_metrics(pid, &stats);
+}
+
+int main()
+{
+    pid_t zombies[numberOfZombies];
+    struct timespec start, end;
+    double base, extra;
+    siginfo_t info;
+
+    if (bench_parse_stat() == -1 || bench_parse_fields() == -1)
+        return 1;
+
+    for (int i = 0; i < numberOfZombies; i++)
+    {
+        zombies[i] = fork();
+        if (zombies[i] == 0)
+            _exit(0);
+    }
+    for (int i = 0; i < numberOfZombies; i++) // every child has exited, none reaped yet
+        waitid(P_PID, zombies[i], &info, WEXITED | WNOWAIT);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < numberOfZombies; i++)
+            read_zombie(zombies[i], 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    base = elapsed_ns(&start, &end) / (rounds * numberOfZombies);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < numberOfZombies; i++)
+            read_zombie(zombies[i], 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    extra = elapsed_ns(&start, &end) / (rounds * numberOfZombies);
+
+    for (int i = 0; i < numberOfZombies; i++)
+        waitpid(zombies[i], NULL, 0);
+
+    printf("stat + status reads    %8.1f us per process\n", base / 1000);
+    printf("io + schedstat reads   %8.1f us per process (budget %.0f us)\n", extra / 1000, extraBudget / 1000);
+    if (extra > extraBudget)
+    {
+        printf("FAIL: extended metrics cost more than %.0f us per process\n", extraBudget / 1000);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}